@@ -1,239 +1,3485 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
-#include <map>
+#include <list>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
 #include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ANAGRAM_X86 1
+#endif
 
-typedef std::pair<std::string, int> WordScore;
-typedef std::map<std::string, int> WordScoreMap;
+// Per-letter counts of a word (or phrase), computed once when the word is
+// loaded so containment tests never have to re-sort strings.
+struct Signature
+{
+    // Padded to a full 32-byte vector; counts past LETTERS are always zero
+    enum { LETTERS = 26, SIZE = 32 };
+
+    unsigned char counts[SIZE];
+
+    Signature();
+    explicit Signature(const std::string &word);
+
+    inline bool contains(const Signature &other) const;
+
+    // Bit i is set when letter i occurs, bit 32 + i when it occurs two or
+    // more times. A word can only fit in letters whose mask covers its own,
+    // which rejects most words with a single AND.
+    inline uint64_t mask() const;
+
+    bool operator<(const Signature &other) const;
+};
+
+// A Signature packed by a LetterPacking, see below
+typedef unsigned __int128 PackedLetters;
+
+// All dictionary words sharing one signature (listen/silent/enlist). The
+// search only ever deals in classes; words are expanded at output time.
+struct WordClass
+{
+    int firstWord; // index of the class's first word in the Dictionary
+    int wordCount;
+    int length;
+    int score;
+    uint32_t letters; // bit i is set when letter i occurs
+    Signature signature;
+    PackedLetters packed;
+};
+
+// A finished phrase whose text lives in a SearchContext's text arena. The
+// offset is full width: without a memory ceiling the arena can pass 4GB.
+struct Answer
+{
+    size_t offset;
+    uint32_t length;
+    int score;
+};
+
+typedef std::pair<std::string_view, int> WordScore;
+typedef std::vector<Answer> AnswerList;
+typedef std::vector<WordClass> WordClassList;
 typedef std::vector<WordScore> WordScoreList;
 
-class Solver
+Signature::Signature()
+{
+    memset(counts, 0, sizeof(counts));
+}
+
+Signature::Signature(const std::string &word)
+{
+    memset(counts, 0, sizeof(counts));
+    for(std::string::const_iterator it = word.begin(); it != word.end(); ++it) {
+        unsigned int letter = (unsigned char)*it - 'a';
+        if(letter < LETTERS)
+            ++counts[letter];
+    }
+}
+
+inline bool Signature::contains(const Signature &other) const
+{
+    // No early out: every letter is compared so the loop vectorizes
+    int overflow = 0;
+    for(int i = 0; i < SIZE; ++i) {
+        overflow |= (int)counts[i] < (int)other.counts[i];
+    }
+    return !overflow;
+}
+
+inline uint64_t Signature::mask() const
+{
+    uint32_t present = 0;
+    uint32_t repeated = 0;
+    for(int i = 0; i < LETTERS; ++i) {
+        present |= (uint32_t)(counts[i] > 0) << i;
+        repeated |= (uint32_t)(counts[i] > 1) << i;
+    }
+    return ((uint64_t)repeated << 32) | present;
+}
+
+bool Signature::operator<(const Signature &other) const
+{
+    return memcmp(counts, other.counts, sizeof(counts)) < 0;
+}
+
+// Per-query layout that packs a Signature into one 128-bit integer. Each
+// letter of the query gets a field just wide enough for its count in the
+// query plus a guard bit on top, and letters the query lacks get no field
+// at all. With the guards set, subtracting a word can never borrow across
+// fields, so "does it fit" is one subtraction and one mask test and
+// "use it" is one subtraction.
+class LetterPacking
+{
+public:
+    // Returns false if the query's fields need more than 128 bits
+    bool build(const Signature &query);
+
+    // Only valid for signatures the query contains
+    PackedLetters pack(const Signature &signature) const;
+
+    inline bool fits(PackedLetters remaining, PackedLetters word) const
+    {
+        return (((remaining | guards_) - word) & guards_) == guards_;
+    }
+
+    inline bool has(PackedLetters packed, int letter) const
+    {
+        return (packed & fields_[letter]) != 0;
+    }
+
+protected:
+    int shifts_[Signature::LETTERS];
+    PackedLetters fields_[Signature::LETTERS]; // value bits of each field, guard excluded
+    PackedLetters guards_;
+};
+
+bool LetterPacking::build(const Signature &query)
+{
+    int bits = 0;
+    guards_ = 0;
+    for(int i = 0; i < Signature::LETTERS; ++i) {
+        shifts_[i] = -1;
+        fields_[i] = 0;
+        int count = query.counts[i];
+        if(!count)
+            continue;
+
+        int valueBits = 0;
+        while(count >> valueBits)
+            ++valueBits;
+        if(bits + valueBits + 1 > 128)
+            return false;
+
+        shifts_[i] = bits;
+        fields_[i] = (((PackedLetters)1 << valueBits) - 1) << bits;
+        guards_ |= (PackedLetters)1 << (bits + valueBits);
+        bits += valueBits + 1;
+    }
+    return true;
+}
+
+PackedLetters LetterPacking::pack(const Signature &signature) const
+{
+    PackedLetters packed = 0;
+    for(int i = 0; i < Signature::LETTERS; ++i) {
+        if(shifts_[i] >= 0)
+            packed |= (PackedLetters)signature.counts[i] << shifts_[i];
+    }
+    return packed;
+}
+
+// On-disk layout written by --build-index. Every section is addressed by its
+// offset from the start of the file, so an index can be mmapped anywhere and
+// used in place without any parsing.
+#define INDEX_MAGIC "ANAGIDX"
+#define INDEX_VERSION 3
+
+struct IndexHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t maxLength;
+    uint32_t wordCount;
+    uint32_t classCount;
+    uint64_t textOffset;    // NUL-terminated words, grouped by class
+    uint64_t textSize;
+    uint64_t wordsOffset;   // uint32_t text offset per word
+    uint64_t classesOffset; // IndexClass per class, ordered by length
+    uint64_t signaturesOffset; // Signature per class, same order
+    uint64_t masksOffset;   // uint64_t Signature::mask() per class, same order
+    uint64_t lengthsOffset; // uint32_t first class of each length, maxLength + 2 entries
+};
+
+struct IndexClass
+{
+    uint32_t firstWord;
+    uint32_t wordCount;
+    unsigned char length;
+    unsigned char reserved[3];
+};
+
+// Words grouped into signature classes, either built from a word list or
+// mapped read-only from a prebuilt index. Both paths end up behind the same
+// pointers, so nothing else cares where the data came from.
+class Dictionary
+{
+public:
+    Dictionary();
+    ~Dictionary();
+
+    bool load(const std::string &filename);
+    bool writeIndex(const std::string &filename) const;
+
+    int maxLength() const { return (int)maxLength_; }
+    int wordCount() const { return (int)wordCount_; }
+    int classCount() const { return (int)classCount_; }
+
+    const IndexClass &wordClass(int index) const { return classes_[index]; }
+    const char *word(int index) const { return text_ + words_[index]; }
+
+    // Kept apart from IndexClass so seeding can stream through them
+    const Signature *signatures() const { return signatures_; }
+    const uint64_t *masks() const { return masks_; }
+
+    // Classes are ordered by length, so every class no longer than length
+    // lives in [0, classesUpToLength(length)).
+    int classesUpToLength(int length) const;
+
+protected:
+    bool loadWords(const std::string &filename);
+    bool loadIndex(const std::string &filename);
+    void unload();
+
+    uint32_t maxLength_;
+    uint32_t wordCount_;
+    uint32_t classCount_;
+    uint64_t textSize_;
+    const char *text_;
+    const uint32_t *words_;
+    const IndexClass *classes_;
+    const Signature *signatures_;
+    const uint64_t *masks_;
+    const uint32_t *lengthStarts_;
+
+    // Backing storage when loaded from a word list
+    std::vector<char> textStorage_;
+    std::vector<uint32_t> wordStorage_;
+    std::vector<IndexClass> classStorage_;
+    std::vector<Signature> signatureStorage_;
+    std::vector<uint64_t> maskStorage_;
+    std::vector<uint32_t> lengthStorage_;
+
+    // Backing storage when loaded from an index
+    void *mapping_;
+    size_t mappingSize_;
+};
+
+Dictionary::Dictionary()
+: maxLength_(0)
+, wordCount_(0)
+, classCount_(0)
+, textSize_(0)
+, text_(NULL)
+, words_(NULL)
+, classes_(NULL)
+, signatures_(NULL)
+, masks_(NULL)
+, lengthStarts_(NULL)
+, mapping_(NULL)
+, mappingSize_(0)
+{
+}
+
+Dictionary::~Dictionary()
+{
+    unload();
+}
+
+void Dictionary::unload()
+{
+    if(mapping_) {
+        munmap(mapping_, mappingSize_);
+        mapping_ = NULL;
+        mappingSize_ = 0;
+    }
+    textStorage_.clear();
+    wordStorage_.clear();
+    classStorage_.clear();
+    signatureStorage_.clear();
+    maskStorage_.clear();
+    lengthStorage_.clear();
+    maxLength_ = wordCount_ = classCount_ = 0;
+    textSize_ = 0;
+    text_ = NULL;
+    words_ = NULL;
+    classes_ = NULL;
+    signatures_ = NULL;
+    masks_ = NULL;
+    lengthStarts_ = NULL;
+}
+
+bool Dictionary::load(const std::string &filename)
+{
+    unload();
+
+    char magic[sizeof(INDEX_MAGIC)] = { 0 };
+    FILE *f = fopen(filename.c_str(), "rb");
+    if(!f) {
+        return false;
+    }
+    size_t bytesRead = fread(magic, 1, sizeof(magic), f);
+    fclose(f);
+
+    if((bytesRead == sizeof(magic)) && !memcmp(magic, INDEX_MAGIC, sizeof(magic))) {
+        return loadIndex(filename);
+    }
+    return loadWords(filename);
+}
+
+int Dictionary::classesUpToLength(int length) const
+{
+    if(length < 0)
+        return 0;
+    if(length > (int)maxLength_)
+        return (int)classCount_;
+    return (int)lengthStarts_[length + 1];
+}
+
+// Orders word indices so that each signature class is one contiguous run,
+// with runs ordered by length
+struct SortWordIndices
+{
+    const std::vector<std::string> *words;
+    const std::vector<Signature> *signatures;
+
+    bool operator()(uint32_t a, uint32_t b) const
+    {
+        const std::string &wordA = (*words)[a];
+        const std::string &wordB = (*words)[b];
+        if(wordA.size() != wordB.size())
+            return wordA.size() < wordB.size();
+        int cmp = memcmp((*signatures)[a].counts, (*signatures)[b].counts, sizeof(Signature::counts));
+        if(cmp != 0)
+            return cmp < 0;
+        return wordA < wordB;
+    }
+};
+
+bool Dictionary::loadWords(const std::string &filename)
+{
+    std::ifstream f(filename.c_str());
+    if(!f) {
+        return false;
+    }
+
+    std::vector<std::string> words;
+    std::vector<Signature> signatures;
+    std::string word;
+    while(std::getline(f, word)) {
+        // IndexClass stores the length in a byte
+        if(word.empty() || (word.size() > 255))
+            continue;
+
+        words.push_back(word);
+        signatures.push_back(Signature(word));
+    }
+
+    std::vector<uint32_t> order(words.size());
+    for(uint32_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    SortWordIndices sortWordIndices = { &words, &signatures };
+    std::sort(order.begin(), order.end(), sortWordIndices);
+
+    textStorage_.reserve(words.size() * 10);
+    wordStorage_.reserve(words.size());
+    for(size_t i = 0; i < order.size(); ++i) {
+        const std::string &current = words[order[i]];
+        const Signature &signature = signatures[order[i]];
+
+        bool newClass = signatureStorage_.empty()
+            || memcmp(signatureStorage_.back().counts, signature.counts, sizeof(signature.counts));
+        if(newClass) {
+            IndexClass entry;
+            memset(&entry, 0, sizeof(entry));
+            signatureStorage_.push_back(signature);
+            maskStorage_.push_back(signature.mask());
+            entry.length = (unsigned char)current.size();
+            entry.firstWord = (uint32_t)wordStorage_.size();
+            classStorage_.push_back(entry);
+            if(entry.length > maxLength_)
+                maxLength_ = entry.length;
+        }
+        ++classStorage_.back().wordCount;
+
+        wordStorage_.push_back((uint32_t)textStorage_.size());
+        textStorage_.insert(textStorage_.end(), current.begin(), current.end());
+        textStorage_.push_back(0);
+    }
+
+    // lengthStorage_[length] is the first class of at least that length
+    lengthStorage_.resize(maxLength_ + 2);
+    uint32_t classIndex = 0;
+    for(uint32_t length = 0; length < lengthStorage_.size(); ++length) {
+        while((classIndex < classStorage_.size()) && (classStorage_[classIndex].length < length))
+            ++classIndex;
+        lengthStorage_[length] = classIndex;
+    }
+
+    wordCount_ = (uint32_t)wordStorage_.size();
+    classCount_ = (uint32_t)classStorage_.size();
+    textSize_ = textStorage_.size();
+    text_ = textStorage_.empty() ? NULL : &textStorage_[0];
+    words_ = wordStorage_.empty() ? NULL : &wordStorage_[0];
+    classes_ = classStorage_.empty() ? NULL : &classStorage_[0];
+    signatures_ = signatureStorage_.empty() ? NULL : &signatureStorage_[0];
+    masks_ = maskStorage_.empty() ? NULL : &maskStorage_[0];
+    lengthStarts_ = &lengthStorage_[0];
+    return true;
+}
+
+// Sections start on 32-byte boundaries, so every 32-byte signature in the
+// mapping sits within one cache line and the filter's unaligned vector
+// loads never straddle two
+static uint64_t alignOffset(uint64_t offset)
+{
+    return (offset + 31) & ~(uint64_t)31;
+}
+
+static bool writePadded(FILE *f, const void *data, uint64_t size, uint64_t &offset)
+{
+    static const char zeros[32] = { 0 };
+    uint64_t padding = alignOffset(offset) - offset;
+    if(padding && (fwrite(zeros, 1, (size_t)padding, f) != padding))
+        return false;
+    if(size && (fwrite(data, 1, (size_t)size, f) != size))
+        return false;
+    offset += padding + size;
+    return true;
+}
+
+bool Dictionary::writeIndex(const std::string &filename) const
+{
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = INDEX_VERSION;
+    header.maxLength = maxLength_;
+    header.wordCount = wordCount_;
+    header.classCount = classCount_;
+    header.textOffset = alignOffset(sizeof(header));
+    header.textSize = textSize_;
+    header.wordsOffset = alignOffset(header.textOffset + header.textSize);
+    header.classesOffset = alignOffset(header.wordsOffset + wordCount_ * sizeof(uint32_t));
+    header.signaturesOffset = alignOffset(header.classesOffset + classCount_ * sizeof(IndexClass));
+    header.masksOffset = alignOffset(header.signaturesOffset + classCount_ * sizeof(Signature));
+    header.lengthsOffset = alignOffset(header.masksOffset + classCount_ * sizeof(uint64_t));
+
+    FILE *f = fopen(filename.c_str(), "wb");
+    if(!f) {
+        return false;
+    }
+
+    uint64_t offset = 0;
+    bool ok = writePadded(f, &header, sizeof(header), offset)
+        && writePadded(f, text_, textSize_, offset)
+        && writePadded(f, words_, wordCount_ * sizeof(uint32_t), offset)
+        && writePadded(f, classes_, classCount_ * sizeof(IndexClass), offset)
+        && writePadded(f, signatures_, classCount_ * sizeof(Signature), offset)
+        && writePadded(f, masks_, classCount_ * sizeof(uint64_t), offset)
+        && writePadded(f, lengthStarts_, (maxLength_ + 2) * sizeof(uint32_t), offset);
+    if(fclose(f) != 0)
+        ok = false;
+    return ok;
+}
+
+bool Dictionary::loadIndex(const std::string &filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(IndexHeader))) {
+        close(fd);
+        return false;
+    }
+
+    void *mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED) {
+        return false;
+    }
+    mapping_ = mapping;
+    mappingSize_ = (size_t)st.st_size;
+
+    // Only the header is checked; the sections are trusted as written by
+    // writeIndex() so that loading stays free of per-word work.
+    const char *base = (const char *)mapping;
+    const IndexHeader *header = (const IndexHeader *)base;
+    uint64_t size = mappingSize_;
+    bool valid = (header->version == INDEX_VERSION)
+        && (header->textOffset <= size) && (header->textSize <= size - header->textOffset)
+        && (header->wordsOffset <= size) && ((uint64_t)header->wordCount * sizeof(uint32_t) <= size - header->wordsOffset)
+        && (header->classesOffset <= size) && ((uint64_t)header->classCount * sizeof(IndexClass) <= size - header->classesOffset)
+        && (header->signaturesOffset <= size) && ((uint64_t)header->classCount * sizeof(Signature) <= size - header->signaturesOffset)
+        && (header->masksOffset <= size) && ((uint64_t)header->classCount * sizeof(uint64_t) <= size - header->masksOffset)
+        && (header->lengthsOffset <= size) && (((uint64_t)header->maxLength + 2) * sizeof(uint32_t) <= size - header->lengthsOffset)
+        && !((header->wordsOffset | header->classesOffset | header->signaturesOffset | header->masksOffset | header->lengthsOffset) & 31);
+    if(!valid) {
+        unload();
+        return false;
+    }
+
+    maxLength_ = header->maxLength;
+    wordCount_ = header->wordCount;
+    classCount_ = header->classCount;
+    textSize_ = header->textSize;
+    text_ = base + header->textOffset;
+    words_ = (const uint32_t *)(base + header->wordsOffset);
+    classes_ = (const IndexClass *)(base + header->classesOffset);
+    signatures_ = (const Signature *)(base + header->signaturesOffset);
+    masks_ = (const uint64_t *)(base + header->masksOffset);
+    lengthStarts_ = (const uint32_t *)(base + header->lengthsOffset);
+    return true;
+}
+
+// Orders answers like sortScores(): best score first, then alphabetically
+struct AnswerOrder
+{
+    const char *text;
+
+    bool operator()(const Answer &a, const Answer &b) const
+    {
+        if(a.score != b.score)
+            return b.score < a.score;
+        return std::string_view(text + a.offset, a.length) < std::string_view(text + b.offset, b.length);
+    }
+};
+
+static inline uint64_t hashPacked(PackedLetters packed)
+{
+    // Fold the halves together, then a 64-bit finalizer to spread the bits
+    uint64_t hash = (uint64_t)packed ^ ((uint64_t)(packed >> 64) * 0x9e3779b97f4a7c15ULL);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// Open-addressing map from an exact signature to the index of the class
+// with that signature, so the last word of a phrase is found with a single
+// probe sequence instead of a scan.
+class SignatureTable
+{
+public:
+    void build(const WordClassList &classes);
+    inline int find(PackedLetters packed) const;
+
+protected:
+    const WordClassList *classes_;
+    std::vector<int> slots_; // class index, or -1 when empty
+    size_t mask_;
+};
+
+void SignatureTable::build(const WordClassList &classes)
+{
+    size_t capacity = 16;
+    while(capacity < classes.size() * 2)
+        capacity <<= 1;
+
+    classes_ = &classes;
+    slots_.assign(capacity, -1);
+    mask_ = capacity - 1;
+    for(size_t i = 0; i < classes.size(); ++i) {
+        size_t slot = (size_t)hashPacked(classes[i].packed) & mask_;
+        while(slots_[slot] != -1)
+            slot = (slot + 1) & mask_;
+        slots_[slot] = (int)i;
+    }
+}
+
+inline int SignatureTable::find(PackedLetters packed) const
+{
+    size_t slot = (size_t)hashPacked(packed) & mask_;
+    for(;;) {
+        int classIndex = slots_[slot];
+        if(classIndex == -1)
+            return -1;
+        if((*classes_)[classIndex].packed == packed)
+            return classIndex;
+        slot = (slot + 1) & mask_;
+    }
+}
+
+// A sub-problem of the search: cover the letters in remaining. While the
+// letter being covered has not run out, letter is that letter and first the
+// lowest class index still allowed for it; otherwise letter is -1, first 0,
+// and the sub-problem depends on remaining alone.
+struct MemoKey
+{
+    PackedLetters remaining;
+    int first;
+    int letter;
+
+    bool operator==(const MemoKey &other) const
+    {
+        return (first == other.first) && (letter == other.letter) && (remaining == other.remaining);
+    }
+};
+
+struct MemoKeyHash
+{
+    size_t operator()(const MemoKey &key) const
+    {
+        uint64_t hash = hashPacked(key.remaining);
+        hash = (hash ^ (uint64_t)(key.first * 32 + key.letter + 1)) * 1099511628211ULL;
+        return (size_t)(hash ^ (hash >> 29));
+    }
+};
+
+// Everything the search needs to know about a MemoKey's completions
+struct Completions
+{
+    uint64_t count; // distinct word multisets, saturating at UINT64_MAX
+    int best;       // highest score among them, -1 when there are none
+    int letter;     // the letter every completion covers first
+
+    // The classes, ascending, that start at least one completion; together
+    // with the sub-problems they lead to these form a DAG of all answers
+    uint32_t firstEdge;
+    uint32_t edgeCount;
+};
+
+// Open-addressing map from MemoKey to Completions. Entries sit in one flat
+// array probed linearly and their edges in one shared pool, so a lookup
+// touches a cache line or two instead of chasing pointers. With a limit
+// set, reaching it flushes the whole memo; whatever is needed again is
+// simply recomputed.
+class CompletionMemo
+{
+public:
+    CompletionMemo();
+
+    // Approximate cap on the memo's memory; 0 means unbounded
+    void setLimit(size_t bytes) { limit_ = bytes; }
+
+    inline bool find(const MemoKey &key, Completions &value) const;
+
+    // Edges of sub-problems still being solved are stacked here until
+    // insert() moves everything above mark into the pool
+    size_t mark() const { return pending_.size(); }
+    void pushEdge(int classIndex) { pending_.push_back(classIndex); }
+    void insert(const MemoKey &key, Completions &value, size_t mark);
+    void discard(size_t mark) { pending_.resize(mark); }
+
+    // Appends value's edges to out. Copy them out before the next insert(),
+    // which may flush the pool.
+    void edges(const Completions &value, std::vector<int> &out) const;
+
+    size_t size() const { return size_; }
+    size_t bytes() const { return slots_.size() * sizeof(Entry) + pool_.size() * sizeof(int); }
+    size_t peakBytes() const { return peak_; }
+    size_t evictions() const { return evictions_; }
+
+protected:
+    struct Entry
+    {
+        MemoKey key; // key.first is -1 when the slot is empty
+        Completions value;
+    };
+
+    void grow();
+    void flush();
+
+    std::vector<Entry> slots_;
+    std::vector<int> pool_;
+    std::vector<int> pending_;
+    size_t mask_;
+    size_t size_;
+    size_t limit_;
+    size_t peak_;
+    size_t evictions_;
+};
+
+CompletionMemo::CompletionMemo()
+: mask_(1023)
+, size_(0)
+, limit_(0)
+, peak_(0)
+, evictions_(0)
+{
+    Entry empty;
+    memset(&empty, 0, sizeof(empty));
+    empty.key.first = -1;
+    slots_.assign(mask_ + 1, empty);
+}
+
+inline bool CompletionMemo::find(const MemoKey &key, Completions &value) const
+{
+    size_t slot = MemoKeyHash()(key) & mask_;
+    for(;;) {
+        const Entry &entry = slots_[slot];
+        if(entry.key.first == -1)
+            return false;
+        if(entry.key == key) {
+            value = entry.value;
+            return true;
+        }
+        slot = (slot + 1) & mask_;
+    }
+}
+
+void CompletionMemo::insert(const MemoKey &key, Completions &value, size_t mark)
+{
+    size_t edgeCount = pending_.size() - mark;
+
+    // Keep the load at or below one half so probe runs stay short
+    bool grows = (size_ + 1) * 2 > slots_.size();
+    if(limit_) {
+        size_t needed = slots_.size() * (grows ? 2 : 1) * sizeof(Entry) + (pool_.size() + edgeCount) * sizeof(int);
+        if(needed > limit_) {
+            flush();
+            grows = false;
+        }
+    }
+    if(grows)
+        grow();
+
+    value.firstEdge = (uint32_t)pool_.size();
+    value.edgeCount = (uint32_t)edgeCount;
+    pool_.insert(pool_.end(), pending_.begin() + mark, pending_.end());
+    pending_.resize(mark);
+
+    size_t slot = MemoKeyHash()(key) & mask_;
+    while((slots_[slot].key.first != -1) && !(slots_[slot].key == key))
+        slot = (slot + 1) & mask_;
+    if(slots_[slot].key.first == -1)
+        ++size_;
+    slots_[slot].key = key;
+    slots_[slot].value = value;
+    peak_ = std::max(peak_, bytes());
+}
+
+void CompletionMemo::edges(const Completions &value, std::vector<int> &out) const
+{
+    out.insert(out.end(), pool_.begin() + value.firstEdge, pool_.begin() + value.firstEdge + value.edgeCount);
+}
+
+void CompletionMemo::grow()
+{
+    std::vector<Entry> old;
+    old.swap(slots_);
+
+    Entry empty;
+    memset(&empty, 0, sizeof(empty));
+    empty.key.first = -1;
+    mask_ = old.size() * 2 - 1;
+    slots_.assign(mask_ + 1, empty);
+    for(std::vector<Entry>::iterator it = old.begin(); it != old.end(); ++it) {
+        if(it->key.first == -1)
+            continue;
+        size_t slot = MemoKeyHash()(it->key) & mask_;
+        while(slots_[slot].key.first != -1)
+            slot = (slot + 1) & mask_;
+        slots_[slot] = *it;
+    }
+}
+
+void CompletionMemo::flush()
+{
+    for(std::vector<Entry>::iterator it = slots_.begin(); it != slots_.end(); ++it) {
+        it->key.first = -1;
+    }
+    evictions_ += size_;
+    size_ = 0;
+    pool_.clear();
+}
+
+// Everything one search thread mutates: the letters not yet used by phrase,
+// which holds the indices into Solver::classes_ chosen so far (one entry per
+// depth), plus that thread's answers and stats.
+struct SearchContext
+{
+    PackedLetters remaining;
+    std::vector<int> phrase;
+    long long iterations;
+    uint64_t ticks; // search() calls, to pace deadline checks
+
+    // Sub-problems this thread has solved, so reaching the same letters
+    // again by another route costs a lookup, and a stack of their edges
+    // being walked
+    CompletionMemo memo;
+    std::vector<int> edges;
+
+    // Answer text back to back, so storing an answer costs no allocation of
+    // its own. In top-K mode answers is a heap with the worst on top, and
+    // the text of evicted answers is reclaimed by Solver::compact().
+    std::vector<char> text;
+    AnswerList answers;
+    size_t liveText;
+
+    // Under a memory ceiling, answers beyond answerLimit bytes are sorted
+    // and spilled to temporary files, one run per spill, for
+    // Solver::writeRuns() to merge
+    size_t answerLimit;
+    size_t peakAnswerBytes;
+    std::vector<FILE *> runs;
+
+    // emit() scratch, kept so expanding a phrase allocates nothing once warm
+    std::vector<int> sorted;
+    std::vector<const char *> words;
+    std::vector<int> choice;
+
+    SearchContext()
+    : remaining(0)
+    , iterations(0)
+    , ticks(0)
+    , liveText(0)
+    , answerLimit(0)
+    , peakAnswerBytes(0)
+    {
+    }
+};
+
+// A mutex-guarded deque of tasks owned by one worker. The owner takes from
+// the front; idle workers steal from the back.
+class WorkQueue
+{
+public:
+    void push(int task)
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        tasks_.push_back(task);
+    }
+
+    bool pop(int &task)
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if(tasks_.empty())
+            return false;
+        task = tasks_.front();
+        tasks_.pop_front();
+        return true;
+    }
+
+    bool steal(int &task)
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if(tasks_.empty())
+            return false;
+        task = tasks_.back();
+        tasks_.pop_back();
+        return true;
+    }
+
+protected:
+    std::mutex lock_;
+    std::deque<int> tasks_;
+};
+
+// Answers handed from a streaming search to its reader. Bounded, so a
+// reader that falls behind stalls the search rather than letting answers
+// pile up; cancel() releases a search stalled that way.
+class AnswerQueue
+{
+public:
+    AnswerQueue()
+    : capacity_(4096)
+    , closed_(false)
+    , cancelled_(false)
+    {
+    }
+
+    void reset()
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        answers_.clear();
+        closed_ = false;
+        cancelled_ = false;
+    }
+
+    // False once the reader has gone away
+    bool push(std::string &answer)
+    {
+        std::unique_lock<std::mutex> guard(lock_);
+        notFull_.wait(guard, [this] { return (answers_.size() < capacity_) || cancelled_; });
+        if(cancelled_)
+            return false;
+        answers_.push_back(std::string());
+        answers_.back().swap(answer);
+        notEmpty_.notify_one();
+        return true;
+    }
+
+    // False once every answer has been taken and the search is over
+    bool pop(std::string &answer)
+    {
+        std::unique_lock<std::mutex> guard(lock_);
+        notEmpty_.wait(guard, [this] { return !answers_.empty() || closed_; });
+        if(answers_.empty())
+            return false;
+        answer.swap(answers_.front());
+        answers_.pop_front();
+        notFull_.notify_one();
+        return true;
+    }
+
+    // True if pop() would return without waiting
+    bool ready()
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        return !answers_.empty() || closed_;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        closed_ = true;
+        notEmpty_.notify_all();
+    }
+
+    void cancel()
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        cancelled_ = true;
+        notFull_.notify_all();
+    }
+
+protected:
+    std::mutex lock_;
+    std::condition_variable notEmpty_;
+    std::condition_variable notFull_;
+    std::deque<std::string> answers_;
+    size_t capacity_;
+    bool closed_;
+    bool cancelled_;
+};
+
+// On-disk layout written by --dag binary, in the style of the index: each
+// section is addressed by its offset from the start of the file.
+#define DAG_MAGIC "ANAGDAG"
+#define DAG_VERSION 1
+
+struct DagHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t nodeCount;
+    uint32_t edgeCount;
+    uint32_t classCount;
+    uint64_t nodesOffset;   // DagNode per node
+    uint64_t edgesOffset;   // DagEdge per edge, grouped by source node
+    uint64_t classesOffset; // DagClass per word class on some edge
+    uint64_t textOffset;    // NUL-terminated words, grouped by class
+    uint64_t textSize;
+};
+
+struct DagNode
+{
+    uint64_t count;  // word multisets completing this node, saturating
+    int32_t best;    // best score among them
+    uint32_t length; // letters left to cover
+    uint32_t firstEdge;
+    uint32_t edgeCount;
+};
+
+// Adding copies words of one class takes the letters of the source node
+// to those of target
+struct DagEdge
+{
+    uint32_t wordClass;
+    uint32_t copies;
+    uint32_t target;
+};
+
+struct DagClass
+{
+    uint32_t textOffset;
+    uint32_t wordCount;
+};
+
+enum DagFormat
+{
+    DAG_NONE,
+    DAG_BINARY,
+    DAG_DOT
+};
+
+// Every answer to a query as a DAG: the paths from the query node to the
+// empty node spell out exactly the class multisets of the answers, each
+// once, so answers can be counted, ranked or enumerated without ever
+// being listed. Built by Solver::buildDag() and walked by DagWalker.
+struct SolutionDag
+{
+    enum { EMPTY = 0, QUERY = 1 };
+
+    std::vector<DagNode> nodes;
+    std::vector<DagEdge> edges;
+    std::vector<DagClass> classes;
+    std::vector<char> text;
+
+    bool write(FILE *f) const;
+    bool writeDot(FILE *f) const;
+    bool read(const std::string &filename);
+
+    // Appends a class as "word" or "{word|word}"
+    void appendClass(uint32_t wordClass, std::string &out) const;
+};
+
+// Enumerates a SolutionDag's paths one at a time from an explicit stack,
+// so a DAG standing for billions of answers is walked lazily in memory
+// proportional to its depth.
+class DagWalker
+{
+public:
+    explicit DagWalker(const SolutionDag &dag);
+
+    // Moves to the next answer; false once every path has been visited
+    bool next();
+
+    // The edges of the current answer, starting at the query node
+    const std::vector<DagEdge> &path() const { return path_; }
+
+protected:
+    struct Frame
+    {
+        uint32_t node;
+        uint32_t nextEdge;
+    };
+
+    const SolutionDag &dag_;
+    std::vector<Frame> stack_;
+    std::vector<DagEdge> path_;
+};
+
+bool SolutionDag::write(FILE *f) const
+{
+    DagHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DAG_MAGIC, sizeof(DAG_MAGIC));
+    header.version = DAG_VERSION;
+    header.nodeCount = (uint32_t)nodes.size();
+    header.edgeCount = (uint32_t)edges.size();
+    header.classCount = (uint32_t)classes.size();
+    header.nodesOffset = alignOffset(sizeof(header));
+    header.edgesOffset = alignOffset(header.nodesOffset + nodes.size() * sizeof(DagNode));
+    header.classesOffset = alignOffset(header.edgesOffset + edges.size() * sizeof(DagEdge));
+    header.textOffset = alignOffset(header.classesOffset + classes.size() * sizeof(DagClass));
+    header.textSize = text.size();
+
+    uint64_t offset = 0;
+    return writePadded(f, &header, sizeof(header), offset)
+        && writePadded(f, nodes.data(), nodes.size() * sizeof(DagNode), offset)
+        && writePadded(f, edges.data(), edges.size() * sizeof(DagEdge), offset)
+        && writePadded(f, classes.data(), classes.size() * sizeof(DagClass), offset)
+        && writePadded(f, text.data(), text.size(), offset)
+        && (fflush(f) == 0);
+}
+
+bool SolutionDag::writeDot(FILE *f) const
+{
+    fprintf(f, "digraph anagrams {\n");
+    fprintf(f, "    node [shape=box];\n");
+    for(size_t i = 0; i < nodes.size(); ++i) {
+        if(i == EMPTY) {
+            fprintf(f, "    n%d [label=\"done\"];\n", (int)i);
+        } else {
+            fprintf(f, "    n%d [label=\"%u letters\\n%llu answers\"];\n", (int)i, nodes[i].length, (unsigned long long)nodes[i].count);
+        }
+    }
+
+    std::string label;
+    for(size_t i = 0; i < nodes.size(); ++i) {
+        const DagNode &node = nodes[i];
+        for(uint32_t e = node.firstEdge; e < node.firstEdge + node.edgeCount; ++e) {
+            label.clear();
+            appendClass(edges[e].wordClass, label);
+            if(edges[e].copies > 1)
+                label += " x" + std::to_string(edges[e].copies);
+            fprintf(f, "    n%d -> n%u [label=\"%s\"];\n", (int)i, edges[e].target, label.c_str());
+        }
+    }
+    fprintf(f, "}\n");
+    return fflush(f) == 0;
+}
+
+bool SolutionDag::read(const std::string &filename)
+{
+    FILE *f = fopen(filename.c_str(), "rb");
+    if(!f) {
+        return false;
+    }
+
+    DagHeader header;
+    bool ok = (fread(&header, sizeof(header), 1, f) == 1)
+        && !memcmp(header.magic, DAG_MAGIC, sizeof(DAG_MAGIC))
+        && (header.version == DAG_VERSION);
+    if(ok) {
+        nodes.resize(header.nodeCount);
+        edges.resize(header.edgeCount);
+        classes.resize(header.classCount);
+        text.resize(header.textSize);
+        ok = !fseek(f, (long)header.nodesOffset, SEEK_SET) && (fread(nodes.data(), sizeof(DagNode), nodes.size(), f) == nodes.size())
+            && !fseek(f, (long)header.edgesOffset, SEEK_SET) && (fread(edges.data(), sizeof(DagEdge), edges.size(), f) == edges.size())
+            && !fseek(f, (long)header.classesOffset, SEEK_SET) && (fread(classes.data(), sizeof(DagClass), classes.size(), f) == classes.size())
+            && !fseek(f, (long)header.textOffset, SEEK_SET) && (fread(text.data(), 1, text.size(), f) == text.size());
+    }
+    fclose(f);
+
+    // Unlike the index, a DAG is read once and walked by index, so every
+    // reference is checked up front rather than trusted
+    for(size_t i = 0; ok && (i < nodes.size()); ++i) {
+        ok = (nodes[i].firstEdge <= edges.size()) && (nodes[i].edgeCount <= edges.size() - nodes[i].firstEdge);
+    }
+    for(size_t i = 0; ok && (i < edges.size()); ++i) {
+        ok = (edges[i].target < nodes.size()) && (edges[i].wordClass < classes.size());
+    }
+    for(size_t i = 0; ok && (i < classes.size()); ++i) {
+        ok = (classes[i].textOffset < text.size()) && !text.empty() && !text.back();
+    }
+    ok = ok && (nodes.size() > QUERY);
+    return ok;
+}
+
+void SolutionDag::appendClass(uint32_t wordClass, std::string &out) const
+{
+    const DagClass &info = classes[wordClass];
+    if(info.wordCount > 1)
+        out += '{';
+    const char *word = &text[info.textOffset];
+    for(uint32_t w = 0; w < info.wordCount; ++w) {
+        if(w)
+            out += '|';
+        out += word;
+        word += strlen(word) + 1;
+    }
+    if(info.wordCount > 1)
+        out += '}';
+}
+
+DagWalker::DagWalker(const SolutionDag &dag)
+: dag_(dag)
+{
+    Frame root = { SolutionDag::QUERY, 0 };
+    stack_.push_back(root);
+}
+
+bool DagWalker::next()
+{
+    // The previous answer left the empty node on top
+    if(!stack_.empty() && (stack_.back().node == SolutionDag::EMPTY)) {
+        stack_.pop_back();
+        path_.pop_back();
+    }
+
+    // path_ always holds the edges between consecutive frames
+    while(!stack_.empty()) {
+        Frame &top = stack_.back();
+        const DagNode &node = dag_.nodes[top.node];
+        if(top.nextEdge == node.edgeCount) {
+            stack_.pop_back();
+            if(!path_.empty())
+                path_.pop_back();
+            continue;
+        }
+
+        const DagEdge &edge = dag_.edges[node.firstEdge + top.nextEdge++];
+        Frame frame = { edge.target, 0 };
+        stack_.push_back(frame);
+        path_.push_back(edge);
+        if(edge.target == SolutionDag::EMPTY)
+            return true;
+    }
+    return false;
+}
+
+// Sub-problem to DAG node bookkeeping for Solver::buildDag()
+struct DagBuilder
+{
+    SolutionDag *dag;
+    CompletionMemo memo;
+    std::unordered_map<MemoKey, uint32_t, MemoKeyHash> nodes;
+    std::vector<int> classes; // SolutionDag class of each Solver class, or -1
+
+    // The DAG's share of the memory ceiling (0 for none), the most it has
+    // used, and whether it ran out, after which no more nodes are added
+    size_t limit;
+    size_t peak;
+    bool full;
+
+    // What the DAG and the node map hold, counting each map entry's node
+    size_t bytes() const
+    {
+        return dag->nodes.capacity() * sizeof(DagNode)
+            + dag->edges.capacity() * sizeof(DagEdge)
+            + dag->classes.capacity() * sizeof(DagClass)
+            + dag->text.capacity()
+            + nodes.size() * (sizeof(MemoKey) + sizeof(uint32_t) + 2 * sizeof(void *))
+            + nodes.bucket_count() * sizeof(void *);
+    }
+};
+
+class Solver
+{
+public:
+    Solver(const std::string &query);
+    ~Solver();
+
+    void seed(const Dictionary &dictionary);
+
+    static std::string sanitize(const std::string &word);
+
+    void dump(bool dumpWords = false);
+    void solve(FILE *out);
+
+    // Streams the answers instead: start() searches on a thread of its own
+    // and next() hands over each answer, unsorted, as soon as it is found.
+    // next() returns false once there are no more; ready() is true if it
+    // would not block. Top-K is ignored, since it needs every answer first.
+    bool start();
+    bool next(std::string &phrase);
+    bool ready() { return stream_.ready(); }
+    void stop();
+
+    void forceAll() { forceAll_ = true; }
+    void factorOutput() { factored_ = true; }
+
+    // Number of search threads; 0 uses every hardware thread
+    void setThreads(int threads) { threads_ = threads; }
+
+    // Only keep the best topK answers (0 keeps everything)
+    void setTopK(int topK) { topK_ = std::max(topK, 0); }
+
+    // Print how many answers there are instead of the answers themselves
+    void countOnly() { countOnly_ = true; }
+
+    // Write the answers as a SolutionDag instead of listing them
+    void setDagFormat(DagFormat format) { dagFormat_ = format; }
+
+    // Builds the DAG of every answer; false if the query cannot be searched
+    bool buildDag(SolutionDag &dag);
+
+    // Cap on each query's sub-problem memo, shared between its threads
+    void setMemoLimit(size_t bytes) { memoLimit_ = bytes; }
+
+    // Ceiling on the search's memory as a whole: the memo gets at most
+    // half, and answers beyond the rest are spilled to disk (0 for none)
+    void setMemoryLimit(size_t bytes) { memoryLimit_ = bytes; }
+
+    // Stop searching at deadline, or once *cancel becomes true (it may be
+    // set from any thread), keeping the answers found so far. truncated()
+    // says whether the last search was cut short this way.
+    void setDeadline(std::chrono::steady_clock::time_point deadline) { deadline_ = deadline; }
+    void setCancel(const std::atomic<bool> *cancel) { cancel_ = cancel; }
+    bool truncated() const { return truncated_; }
+
+    // Progress and stats go here (stderr by default); NULL silences them
+    void setLog(FILE *log) { log_ = log; }
+
+protected:
+    void log(const char *format, ...);
+
+    bool complete(CompletionMemo &memo, PackedLetters remaining, int remainingLength, int letter, int first, Completions &result) const;
+    template<typename Solve>
+    bool addCopies(int classIndex, PackedLetters remaining, int remainingLength, int letter, Completions &result, bool &exact, Solve solve) const;
+    inline int finalClass(PackedLetters remaining, int remainingLength, int first) const;
+    int pickLetter(PackedLetters remaining, int remainingLength) const;
+    inline bool interrupted(uint64_t tick) const;
+    void search(SearchContext &context, int remainingLength, int letter, int first, int score);
+    bool explore(SearchContext &context, int remainingLength, int letter, int first, int score, Completions &found);
+    void walk(SearchContext &context, const Completions &here, int remainingLength, int score);
+    void branch(SearchContext &context, int classIndex, int remainingLength, int letter, int score);
+    void searchParallel(std::vector<SearchContext> &contexts, const std::vector<int> &tasks, int remainingLength, int letter);
+    void solveCount(FILE *out);
+    void solveDag(FILE *out);
+    uint32_t addDagNode(DagBuilder &builder, PackedLetters remaining, int remainingLength, int letter, int first);
+    uint32_t addDagClass(DagBuilder &builder, int classIndex);
+    bool prepare();
+    bool begin();
+    void searchAll(std::vector<SearchContext> &contexts);
+    void produce();
+    void runWorker(std::vector<WorkQueue> *queues, int worker, SearchContext *context, int remainingLength, int letter);
+    void emit(SearchContext &context, int score);
+    void emitFactored(SearchContext &context, int score);
+    void addAnswer(SearchContext &context, const Answer &answer);
+    void compact(SearchContext &context);
+    size_t memoBudget() const;
+    bool spill(SearchContext &context);
+    void writeRuns(std::vector<SearchContext> &contexts, FILE *out);
+    void logPeak(const std::vector<SearchContext> &contexts, size_t mergeBytes);
+
+    int maxLength_;
+    int minLength_;
+    std::string query_;
+    std::string sortedQuery_;
+    Signature querySignature_;
+    LetterPacking packing_;
+    bool packable_;
+    bool lettersOnly_; // false if the query has anything a Signature drops
+    const Dictionary *dictionary_;
+    WordClassList classes_;
+    SignatureTable classTable_;
+    int wordCount_;
+    bool forceAll_;
+    bool factored_;
+    int threads_;
+    int topK_;
+    bool countOnly_;
+    DagFormat dagFormat_;
+    size_t memoLimit_;
+    size_t memoryLimit_;
+    FILE *log_;
+
+    // Streaming mode: the search thread, the answers it has yet to hand
+    // over, and whether the reader has given up on the rest
+    std::thread producer_;
+    AnswerQueue stream_;
+    bool streaming_;
+
+    // Emit answers while solving sub-problems rather than after, for when
+    // the first answers matter more than the total time
+    bool incremental_;
+
+    // Set once the search should wind down, whether the reader of a stream
+    // gave up or the deadline passed; only the latter two count as truncated
+    mutable std::atomic<bool> stopping_;
+    mutable std::atomic<bool> truncated_;
+    std::chrono::steady_clock::time_point deadline_;
+    const std::atomic<bool> *cancel_;
+
+    // Top-K mode: the lowest score any thread has seen in a full heap. A
+    // partial phrase that cannot reach it can never make the final cut.
+    std::atomic<int> threshold_;
+
+    // covering_[l] lists, ascending, the classes long enough to use that
+    // contain letter l; letterOrder_ has the letters by list size
+    std::vector<int> covering_[Signature::LETTERS];
+    int letterOrder_[Signature::LETTERS];
+};
+
+Solver::Solver(const std::string &query)
+: query_(query)
+, dictionary_(NULL)
+, forceAll_(false)
+, factored_(false)
+, threads_(1)
+, topK_(0)
+, countOnly_(false)
+, dagFormat_(DAG_NONE)
+, memoLimit_(0)
+, memoryLimit_(0)
+, log_(stderr)
+, streaming_(false)
+, incremental_(false)
+, stopping_(false)
+, truncated_(false)
+, deadline_(std::chrono::steady_clock::time_point::max())
+, cancel_(NULL)
+, threshold_(0)
+{
+    sortedQuery_ = sanitize(query_);
+    querySignature_ = Signature(sortedQuery_);
+    packable_ = packing_.build(querySignature_);
+    maxLength_ = (int)sortedQuery_.size();
+    lettersOnly_ = true;
+    for(std::string::const_iterator it = sortedQuery_.begin(); it != sortedQuery_.end(); ++it) {
+        if((*it < 'a') || (*it > 'z'))
+            lettersOnly_ = false;
+    }
+    minLength_ = 1;
+    wordCount_ = 0;
+}
+
+Solver::~Solver()
+{
+    stop();
+}
+
+void Solver::log(const char *format, ...)
+{
+    if(!log_)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(log_, format, args);
+    va_end(args);
+}
+
+// Appends the index of every signature in [0, count) that query contains.
+// The mask test rejects most of the dictionary first; the survivors get the
+// full test, where a signature fits when max(word, query) == query in
+// every byte. The vector versions do that a whole 32-byte signature at a time.
+static void filterMasks(const uint64_t *masks, int count, uint64_t queryMask, std::vector<int> &survivors)
+{
+    survivors.reserve(count / 8);
+    for(int i = 0; i < count; ++i) {
+        if(!(masks[i] & ~queryMask))
+            survivors.push_back(i);
+    }
+}
+
+static void filterSignaturesScalar(const Signature *signatures, const std::vector<int> &survivors, const Signature &query, std::vector<int> &fits)
+{
+    for(std::vector<int>::const_iterator it = survivors.begin(); it != survivors.end(); ++it) {
+        if(query.contains(signatures[*it]))
+            fits.push_back(*it);
+    }
+}
+
+#ifdef ANAGRAM_X86
+__attribute__((target("sse2")))
+static void filterSignaturesSSE2(const Signature *signatures, const std::vector<int> &survivors, const Signature &query, std::vector<int> &fits)
+{
+    __m128i queryLow = _mm_loadu_si128((const __m128i *)query.counts);
+    __m128i queryHigh = _mm_loadu_si128((const __m128i *)(query.counts + 16));
+    for(std::vector<int>::const_iterator it = survivors.begin(); it != survivors.end(); ++it) {
+        const Signature &signature = signatures[*it];
+        __m128i low = _mm_loadu_si128((const __m128i *)signature.counts);
+        __m128i high = _mm_loadu_si128((const __m128i *)(signature.counts + 16));
+        __m128i fit = _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_max_epu8(low, queryLow), queryLow),
+            _mm_cmpeq_epi8(_mm_max_epu8(high, queryHigh), queryHigh));
+        if(_mm_movemask_epi8(fit) == 0xffff)
+            fits.push_back(*it);
+    }
+}
+
+__attribute__((target("avx2")))
+static void filterSignaturesAVX2(const Signature *signatures, const std::vector<int> &survivors, const Signature &query, std::vector<int> &fits)
+{
+    __m256i q = _mm256_loadu_si256((const __m256i *)query.counts);
+    const int *indices = survivors.empty() ? NULL : &survivors[0];
+    int count = (int)survivors.size();
+    int i = 0;
+
+    // Four signatures per pass, so the usual cost is four compares and one
+    // branch
+    for(; i + 4 <= count; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)signatures[indices[i]].counts);
+        __m256i b = _mm256_loadu_si256((const __m256i *)signatures[indices[i + 1]].counts);
+        __m256i c = _mm256_loadu_si256((const __m256i *)signatures[indices[i + 2]].counts);
+        __m256i d = _mm256_loadu_si256((const __m256i *)signatures[indices[i + 3]].counts);
+        unsigned int fitMask = (_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(a, q), q)) == -1)
+            | ((_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(b, q), q)) == -1) << 1)
+            | ((_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(c, q), q)) == -1) << 2)
+            | ((_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(d, q), q)) == -1) << 3);
+        for(; fitMask; fitMask &= fitMask - 1) {
+            fits.push_back(indices[i + __builtin_ctz(fitMask)]);
+        }
+    }
+    for(; i < count; ++i) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)signatures[indices[i]].counts);
+        if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(a, q), q)) == -1)
+            fits.push_back(indices[i]);
+    }
+}
+#endif
+
+static void filterSignatures(const Signature *signatures, const uint64_t *masks, int count, const Signature &query, std::vector<int> &fits)
+{
+    std::vector<int> survivors;
+    filterMasks(masks, count, query.mask(), survivors);
+
+#ifdef ANAGRAM_X86
+    static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+    static const bool hasSSE2 = __builtin_cpu_supports("sse2");
+    if(hasAVX2) {
+        filterSignaturesAVX2(signatures, survivors, query, fits);
+        return;
+    }
+    if(hasSSE2) {
+        filterSignaturesSSE2(signatures, survivors, query, fits);
+        return;
+    }
+#endif
+    filterSignaturesScalar(signatures, survivors, query, fits);
+}
+
+struct SortClasses
+{
+    const Dictionary *dictionary;
+
+    bool operator()(const WordClass &a, const WordClass &b) const
+    {
+        return strcmp(dictionary->word(a.firstWord), dictionary->word(b.firstWord)) < 0;
+    }
+};
+
+void Solver::seed(const Dictionary &dictionary)
+{
+    dictionary_ = &dictionary;
+    classes_.clear();
+    wordCount_ = 0;
+
+    std::vector<int> fits;
+    filterSignatures(dictionary.signatures(), dictionary.masks(), dictionary.classesUpToLength(maxLength_), querySignature_, fits);
+    for(std::vector<int>::iterator it = fits.begin(); it != fits.end(); ++it) {
+        const IndexClass &entry = dictionary.wordClass(*it);
+
+        // Words with characters other than a-z are longer than their
+        // signatures, and would let those characters stand in for letters
+        const Signature &signature = dictionary.signatures()[*it];
+        int letters = 0;
+        for(int letter = 0; letter < Signature::LETTERS; ++letter) {
+            letters += signature.counts[letter];
+        }
+        if(letters != entry.length)
+            continue;
+
+        WordClass wordClass;
+        wordClass.firstWord = (int)entry.firstWord;
+        wordClass.wordCount = (int)entry.wordCount;
+        wordClass.length = entry.length;
+        wordClass.score = wordClass.length * wordClass.length;
+        wordClass.signature = signature;
+        wordClass.packed = packing_.pack(wordClass.signature);
+        wordClass.letters = (uint32_t)wordClass.signature.mask();
+        classes_.push_back(wordClass);
+        wordCount_ += wordClass.wordCount;
+    }
+
+    SortClasses sortClasses = { dictionary_ };
+    std::sort(classes_.begin(), classes_.end(), sortClasses);
+    classTable_.build(classes_);
+}
+
+std::string Solver::sanitize(const std::string &word)
+{
+    std::string sortedWord = word;
+    sortedWord.erase(std::remove(sortedWord.begin(), sortedWord.end(), ' '), sortedWord.end());
+    std::sort(sortedWord.begin(), sortedWord.end());
+    return sortedWord;
+}
+
+void Solver::dump(bool dumpWords)
+{
+    std::vector<int> lengthCounts(maxLength_ + 1, 0);
+    for(WordClassList::iterator it = classes_.begin(); it != classes_.end(); ++it) {
+        ++lengthCounts[it->length];
+    }
+
+    fprintf(stderr, "Current word class counts:\n");
+    for(int i = 0; i <= maxLength_; ++i) {
+        printf("* Classes[%d]: %d\n", i, lengthCounts[i]);
+        if(dumpWords) {
+            for(WordClassList::iterator it = classes_.begin(); it != classes_.end(); ++it) {
+                if(it->length != i)
+                    continue;
+                for(int w = 0; w < it->wordCount; ++w) {
+                    fprintf(stderr, "  * %s\n", dictionary_->word(it->firstWord + w));
+                }
+            }
+        }
+    }
+}
+
+static bool sortScores(WordScore a, WordScore b)
+{
+    if(b.second == a.second) {
+        // Sort identical scores alphabetically
+        return a.first < b.first;
+    }
+    return (b.second < a.second);
+}
+
+static uint64_t saturatingAdd(uint64_t a, uint64_t b)
+{
+    uint64_t sum = a + b;
+    return (sum < a) ? UINT64_MAX : sum;
+}
+
+static uint64_t saturatingMultiply(uint64_t a, uint64_t b)
+{
+    unsigned __int128 product = (unsigned __int128)a * b;
+    return (product > UINT64_MAX) ? UINT64_MAX : (uint64_t)product;
+}
+
+// The block-of-copies step shared by complete() and explore(): tries each
+// number of copies of a class that remaining holds, hands the sub-problem
+// left over to solve() and adds what it finds to result. Clears exact if
+// any solve() was cut short; returns true if some block completes.
+template<typename Solve>
+bool Solver::addCopies(int classIndex, PackedLetters remaining, int remainingLength, int letter, Completions &result, bool &exact, Solve solve) const
+{
+    const WordClass &info = classes_[classIndex];
+    PackedLetters left = remaining;
+    int leftover = remainingLength;
+    uint64_t ways = 1;
+    bool live = false;
+    for(int copies = 1; packing_.fits(left, info.packed); ++copies) {
+        leftover -= info.length;
+        if((leftover > 0) && (leftover < minLength_))
+            break;
+
+        ways = saturatingMultiply(ways, (uint64_t)(info.wordCount + copies - 1)) / (uint64_t)copies;
+        left -= info.packed;
+        bool lasts = packing_.has(left, letter);
+        Completions rest;
+        if(!solve(copies, left, leftover, lasts ? letter : -1, lasts ? classIndex + 1 : 0, rest))
+            exact = false;
+        if(rest.count) {
+            result.count = saturatingAdd(result.count, saturatingMultiply(ways, rest.count));
+            result.best = std::max(result.best, copies * info.score + rest.best);
+            live = true;
+        }
+    }
+    return live;
+}
+
+// Solves the sub-problem of covering remaining, memoized. Every completion
+// must use some class containing the chosen letter, so only those classes
+// are branched on, each as a block of r copies in ascending class order
+// while the letter lasts. That reaches every multiset of classes along
+// exactly one path, and r copies of a class with n words can be spelled
+// C(n + r - 1, r) ways. Returns false if the search was interrupted before
+// result was complete.
+bool Solver::complete(CompletionMemo &memo, PackedLetters remaining, int remainingLength, int letter, int first, Completions &result) const
+{
+    result.count = 0;
+    result.best = -1;
+    result.letter = letter;
+    result.firstEdge = 0;
+    result.edgeCount = 0;
+    if(remainingLength == 0) {
+        result.count = 1;
+        result.best = 0;
+        return true;
+    }
+
+    // Too short for two words: only the class matching every remaining
+    // letter can finish, and the signature table finds it directly
+    if(remainingLength < 2 * minLength_) {
+        int classIndex = finalClass(remaining, remainingLength, first);
+        if(classIndex >= 0) {
+            result.count = classes_[classIndex].wordCount;
+            result.best = classes_[classIndex].score;
+        }
+        return true;
+    }
+
+    MemoKey key;
+    key.remaining = remaining;
+    key.first = first;
+    key.letter = letter;
+    if(memo.find(key, result))
+        return true;
+    if(interrupted(memo.size()))
+        return false;
+
+    if(letter < 0)
+        letter = pickLetter(remaining, remainingLength);
+    result.letter = letter;
+    bool exact = true;
+    size_t mark = memo.mark();
+    if(letter >= 0) {
+        const std::vector<int> &covering = covering_[letter];
+        for(std::vector<int>::const_iterator it = std::lower_bound(covering.begin(), covering.end(), first); it != covering.end(); ++it) {
+            bool live = addCopies(*it, remaining, remainingLength, letter, result, exact,
+                [&](int, PackedLetters left, int leftover, int nextLetter, int nextFirst, Completions &rest) {
+                    return complete(memo, left, leftover, nextLetter, nextFirst, rest);
+                });
+            if(live)
+                memo.pushEdge(*it);
+        }
+    }
+
+    // A short count stays out of the memo, so no later lookup takes it for
+    // the full one
+    if(exact)
+        memo.insert(key, result, mark);
+    else
+        memo.discard(mark);
+    return exact;
+}
+
+// Returns the class spelling exactly remaining if it may be used, else -1
+inline int Solver::finalClass(PackedLetters remaining, int remainingLength, int first) const
+{
+    int classIndex = classTable_.find(remaining);
+    if((classIndex < first) || (classes_[classIndex].length < minLength_) || (classes_[classIndex].length != remainingLength))
+        return -1;
+    return classIndex;
+}
+
+// Returns the remaining letter covered by the fewest usable classes, or -1
+// when some remaining letter is covered by none and nothing can finish.
+// A letter never has more usable classes than its whole covering_ list, so
+// letters are tried from the shortest list up and the scan stops once no
+// list left can beat the best count so far.
+int Solver::pickLetter(PackedLetters remaining, int remainingLength) const
+{
+    int letter = -1;
+    int fewest = INT_MAX;
+    for(int i = 0; i < Signature::LETTERS; ++i) {
+        int candidate = letterOrder_[i];
+        const std::vector<int> &covering = covering_[candidate];
+        if((int)covering.size() >= fewest)
+            break;
+        if(!packing_.has(remaining, candidate))
+            continue;
+
+        int count = 0;
+        for(std::vector<int>::const_iterator it = covering.begin(); it != covering.end(); ++it) {
+            const WordClass &info = classes_[*it];
+            if((info.length != remainingLength) && (info.length + minLength_ > remainingLength))
+                continue;
+            if(packing_.fits(remaining, info.packed))
+                ++count;
+        }
+        if(!count)
+            return -1;
+        if(count < fewest) {
+            fewest = count;
+            letter = candidate;
+        }
+    }
+    return letter;
+}
+
+// Cheap enough for the hot loop: a relaxed load, plus a look at the clock
+// and the cancel flag once every 1024 ticks
+inline bool Solver::interrupted(uint64_t tick) const
+{
+    if(stopping_.load(std::memory_order_relaxed))
+        return true;
+    if(tick & 1023)
+        return false;
+
+    bool cancelled = cancel_ && cancel_->load(std::memory_order_relaxed);
+    if(!cancelled && ((deadline_ == std::chrono::steady_clock::time_point::max()) || (std::chrono::steady_clock::now() < deadline_)))
+        return false;
+    truncated_ = true;
+    stopping_ = true;
+    return true;
+}
+
+// Walks the sub-problem's completions along the memo's edges, so every
+// branch taken leads to at least one answer; in top-K mode only branches
+// whose best score can still make the cut are taken
+void Solver::search(SearchContext &context, int remainingLength, int letter, int first, int score)
+{
+    if(incremental_) {
+        Completions found;
+        explore(context, remainingLength, letter, first, score, found);
+        return;
+    }
+    if(interrupted(++context.ticks))
+        return;
+    if(remainingLength == 0) {
+        emit(context, score);
+        return;
+    }
+    if(remainingLength < 2 * minLength_) {
+        int classIndex = finalClass(context.remaining, remainingLength, first);
+        if(classIndex >= 0) {
+            context.phrase.push_back(classIndex);
+            emit(context, score + classes_[classIndex].score);
+            context.phrase.pop_back();
+        }
+        return;
+    }
+
+    Completions here;
+    complete(context.memo, context.remaining, remainingLength, letter, first, here);
+    if(!here.count)
+        return;
+    if(topK_ && (score + here.best < threshold_.load(std::memory_order_relaxed)))
+        return;
+    ++context.iterations;
+    walk(context, here, remainingLength, score);
+}
+
+// search() for incremental mode. A sub-problem already in the memo is
+// walked as usual; a new one is solved depth-first like complete(), but
+// emitting each answer on the way, and memoized afterwards if nothing was
+// pruned or interrupted. found gets what was seen; returns false if that
+// was not everything.
+bool Solver::explore(SearchContext &context, int remainingLength, int letter, int first, int score, Completions &found)
+{
+    found.count = 0;
+    found.best = -1;
+    found.letter = letter;
+    found.firstEdge = 0;
+    found.edgeCount = 0;
+    if(interrupted(++context.ticks))
+        return false;
+    if(remainingLength == 0) {
+        emit(context, score);
+        found.count = 1;
+        found.best = 0;
+        return true;
+    }
+    if(remainingLength < 2 * minLength_) {
+        int classIndex = finalClass(context.remaining, remainingLength, first);
+        if(classIndex >= 0) {
+            context.phrase.push_back(classIndex);
+            emit(context, score + classes_[classIndex].score);
+            context.phrase.pop_back();
+            found.count = classes_[classIndex].wordCount;
+            found.best = classes_[classIndex].score;
+        }
+        return true;
+    }
+
+    MemoKey key;
+    key.remaining = context.remaining;
+    key.first = first;
+    key.letter = letter;
+    int threshold = threshold_.load(std::memory_order_relaxed);
+    if(context.memo.find(key, found)) {
+        if(found.count && (!topK_ || (score + found.best >= threshold))) {
+            ++context.iterations;
+            walk(context, found, remainingLength, score);
+        }
+        return true;
+    }
+
+    // Nothing is known about a new sub-problem yet, but a single word
+    // using every remaining letter outscores any split of them
+    if(topK_ && (score + remainingLength * remainingLength < threshold))
+        return false;
+    ++context.iterations;
+
+    if(letter < 0)
+        letter = pickLetter(context.remaining, remainingLength);
+    found.letter = letter;
+    bool exact = true;
+    size_t mark = context.memo.mark();
+    if(letter >= 0) {
+        const std::vector<int> &covering = covering_[letter];
+        PackedLetters remaining = context.remaining;
+        size_t depth = context.phrase.size();
+        for(std::vector<int>::const_iterator it = std::lower_bound(covering.begin(), covering.end(), first); it != covering.end(); ++it) {
+            const WordClass &info = classes_[*it];
+            bool live = addCopies(*it, remaining, remainingLength, letter, found, exact,
+                [&](int copies, PackedLetters left, int leftover, int nextLetter, int nextFirst, Completions &rest) {
+                    context.phrase.push_back(*it);
+                    context.remaining = left;
+                    return explore(context, leftover, nextLetter, nextFirst, score + copies * info.score, rest);
+                });
+            context.phrase.resize(depth);
+            context.remaining = remaining;
+            if(live)
+                context.memo.pushEdge(*it);
+        }
+    }
+
+    if(exact)
+        context.memo.insert(key, found, mark);
+    else
+        context.memo.discard(mark);
+    return exact;
+}
+
+// Takes every edge of a solved sub-problem
+void Solver::walk(SearchContext &context, const Completions &here, int remainingLength, int score)
+{
+    // Deeper calls may flush the memo, so walk a copy of the edges
+    size_t base = context.edges.size();
+    context.memo.edges(here, context.edges);
+    size_t end = context.edges.size();
+    for(size_t i = base; i < end; ++i) {
+        branch(context, context.edges[i], remainingLength, here.letter, score);
+    }
+    context.edges.resize(base);
+}
+
+// Tries one to as many copies of classIndex as fit, for a sub-problem
+// covering letter
+void Solver::branch(SearchContext &context, int classIndex, int remainingLength, int letter, int score)
+{
+    const WordClass &info = classes_[classIndex];
+    PackedLetters remaining = context.remaining;
+    size_t depth = context.phrase.size();
+    int leftover = remainingLength;
+    while(packing_.fits(context.remaining, info.packed)) {
+        leftover -= info.length;
+        if((leftover > 0) && (leftover < minLength_))
+            break;
+
+        context.phrase.push_back(classIndex);
+        context.remaining -= info.packed;
+        score += info.score;
+        bool lasts = packing_.has(context.remaining, letter);
+        search(context, leftover, lasts ? letter : -1, lasts ? classIndex + 1 : 0, score);
+    }
+    context.phrase.resize(depth);
+    context.remaining = remaining;
+}
+
+// Branches on each of tasks, classes covering letter, from the full query
+void Solver::searchParallel(std::vector<SearchContext> &contexts, const std::vector<int> &tasks, int remainingLength, int letter)
+{
+    // Each class branched on at the top is one task. Early classes have the
+    // most classes left to combine with, so dealing round-robin spreads the
+    // heavy tasks out before any stealing is needed.
+    int workerCount = (int)contexts.size();
+    std::vector<WorkQueue> queues(workerCount);
+    for(size_t i = 0; i < tasks.size(); ++i) {
+        queues[i % workerCount].push(tasks[i]);
+    }
+
+    std::vector<std::thread> workers;
+    for(int worker = 0; worker < workerCount; ++worker) {
+        workers.push_back(std::thread(&Solver::runWorker, this, &queues, worker, &contexts[worker], remainingLength, letter));
+    }
+    for(std::vector<std::thread>::iterator it = workers.begin(); it != workers.end(); ++it) {
+        it->join();
+    }
+}
+
+void Solver::runWorker(std::vector<WorkQueue> *queues, int worker, SearchContext *context, int remainingLength, int letter)
+{
+    // Tasks never spawn more tasks, so once every queue is empty the work is done
+    int workerCount = (int)queues->size();
+    int task;
+    for(;;) {
+        bool found = (*queues)[worker].pop(task);
+        for(int offset = 1; !found && (offset < workerCount); ++offset) {
+            found = (*queues)[(worker + offset) % workerCount].steal(task);
+        }
+        if(!found)
+            break;
+
+        branch(*context, task, remainingLength, letter, 0);
+    }
+}
+
+static bool sortWordText(const char *a, const char *b)
+{
+    return strcmp(a, b) < 0;
+}
+
+static void appendText(std::vector<char> &text, const char *str)
+{
+    text.insert(text.end(), str, str + strlen(str));
+}
+
+void Solver::emit(SearchContext &context, int score)
+{
+    if(topK_) {
+        // Every expansion shares this score, so a full heap can reject them all at once
+        if(((int)context.answers.size() >= topK_) && (score < context.answers.front().score))
+            return;
+        compact(context);
+    }
+
+    // The search picks words in pivot order; output lists classes by index
+    context.sorted.assign(context.phrase.begin(), context.phrase.end());
+    std::sort(context.sorted.begin(), context.sorted.end());
+
+    if(factored_) {
+        emitFactored(context, score);
+        return;
+    }
+
+    // Walk every combination of one word per chosen class, writing each
+    // phrase straight into the text arena. Within a run of one class chosen
+    // several times the word choices never decrease, so each multiset of
+    // words is produced exactly once and nothing needs deduplicating.
+    const std::vector<int> &phrase = context.sorted;
+    size_t count = phrase.size();
+    context.choice.assign(count, 0);
+    context.words.resize(count);
+    for(;;) {
+        for(size_t i = 0; i < count; ++i) {
+            context.words[i] = dictionary_->word(classes_[phrase[i]].firstWord + context.choice[i]);
+        }
+        std::sort(context.words.begin(), context.words.end(), sortWordText);
+
+        Answer answer;
+        answer.offset = context.text.size();
+        answer.score = score;
+        for(size_t i = 0; i < count; ++i) {
+            if(i)
+                context.text.push_back(' ');
+            appendText(context.text, context.words[i]);
+        }
+        answer.length = (uint32_t)(context.text.size() - answer.offset);
+        addAnswer(context, answer);
+
+        // Odometer step; a digit followed by the same class is capped by
+        // that digit, and resetting to 0 never breaks the order
+        size_t i = 0;
+        for(; i < count; ++i) {
+            int last = classes_[phrase[i]].wordCount - 1;
+            if((i + 1 < count) && (phrase[i + 1] == phrase[i]))
+                last = context.choice[i + 1];
+            if(context.choice[i] < last) {
+                ++context.choice[i];
+                break;
+            }
+            context.choice[i] = 0;
+        }
+        if(i == count)
+            break;
+    }
+}
+
+void Solver::emitFactored(SearchContext &context, int score)
+{
+    // One line per class combination, e.g. "{enlist|listen|silent} {ate|eat|tea}\t9".
+    // context.sorted is ascending, so a class chosen r times appears as a run of r
+    // equal indices and contributes C(n + r - 1, r) distinct word choices.
+    std::vector<char> &text = context.text;
+    Answer answer;
+    answer.offset = text.size();
+    answer.score = score;
+
+    unsigned long long expansions = 1;
+    size_t i = 0;
+    while(i < context.sorted.size()) {
+        int classIndex = context.sorted[i];
+        const WordClass &wordClass = classes_[classIndex];
+        unsigned long long n = wordClass.wordCount;
+        unsigned long long choices = 1;
+        for(unsigned long long r = 1; (i < context.sorted.size()) && (context.sorted[i] == classIndex); ++r, ++i) {
+            choices = choices * (n + r - 1) / r;
+
+            if(text.size() != answer.offset)
+                text.push_back(' ');
+            if(n == 1) {
+                appendText(text, dictionary_->word(wordClass.firstWord));
+                continue;
+            }
+            text.push_back('{');
+            for(int w = 0; w < wordClass.wordCount; ++w) {
+                if(w)
+                    text.push_back('|');
+                appendText(text, dictionary_->word(wordClass.firstWord + w));
+            }
+            text.push_back('}');
+        }
+        expansions *= choices;
+    }
+
+    char countText[32];
+    snprintf(countText, sizeof(countText), "\t%llu", expansions);
+    appendText(text, countText);
+    answer.length = (uint32_t)(text.size() - answer.offset);
+
+    addAnswer(context, answer);
+}
+
+// The answer's text must be the tail of context.text; it is dropped from
+// there again if the answer is not kept.
+void Solver::addAnswer(SearchContext &context, const Answer &answer)
+{
+    if(streaming_) {
+        // Nothing is kept, so the arena never holds more than this answer
+        std::string phrase(&context.text[answer.offset], answer.length);
+        context.text.resize(answer.offset);
+        if(!stream_.push(phrase))
+            stopping_ = true;
+        return;
+    }
+    if(!topK_) {
+        context.answers.push_back(answer);
+        size_t bytes = context.text.capacity() + context.answers.capacity() * sizeof(Answer);
+        if(bytes > context.peakAnswerBytes)
+            context.peakAnswerBytes = bytes;
+        // Merging in memory costs a WordScore per answer on top
+        if(context.answerLimit && (context.text.size() + context.answers.size() * (sizeof(Answer) + sizeof(WordScore)) > context.answerLimit))
+            spill(context);
+        return;
+    }
+
+    AnswerList &best = context.answers;
+    AnswerOrder order = { &context.text[0] };
+    if(((int)best.size() >= topK_) && !order(answer, best.front())) {
+        context.text.resize(answer.offset);
+        return;
+    }
+
+    best.push_back(answer);
+    std::push_heap(best.begin(), best.end(), order);
+    context.liveText += answer.length;
+    if((int)best.size() > topK_) {
+        std::pop_heap(best.begin(), best.end(), order);
+        context.liveText -= best.back().length;
+        best.pop_back();
+    }
+
+    if((int)best.size() == topK_) {
+        int worst = best.front().score;
+        int threshold = threshold_.load(std::memory_order_relaxed);
+        while((threshold < worst) && !threshold_.compare_exchange_weak(threshold, worst, std::memory_order_relaxed)) {
+        }
+    }
+}
+
+void Solver::compact(SearchContext &context)
+{
+    // Evicted top-K answers leave dead text behind; once it outweighs the
+    // live text, copy the survivors to the front
+    if(context.text.size() < 2 * context.liveText + 65536)
+        return;
+
+    std::vector<char> &text = context.text;
+    std::vector<Answer> &answers = context.answers;
+    std::vector<uint32_t> order(answers.size());
+    for(uint32_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    // Moving answers in offset order means no copy overwrites text still to be moved
+    std::sort(order.begin(), order.end(), [&answers](uint32_t a, uint32_t b) { return answers[a].offset < answers[b].offset; });
+
+    size_t offset = 0;
+    for(std::vector<uint32_t>::iterator it = order.begin(); it != order.end(); ++it) {
+        Answer &answer = answers[*it];
+        memmove(&text[offset], &text[answer.offset], answer.length);
+        answer.offset = offset;
+        offset += answer.length;
+    }
+    text.resize(offset);
+}
+
+// The memo's share of the budget, the tighter of its own cap and half the
+// memory ceiling; 0 if neither is set
+size_t Solver::memoBudget() const
+{
+    if(memoryLimit_ && (!memoLimit_ || (memoLimit_ > memoryLimit_ / 2)))
+        return memoryLimit_ / 2;
+    return memoLimit_;
+}
+
+// Writes the context's answers, best first, to a new temporary file and
+// empties the arena. If no file can be written the answers stay in memory
+// and the context stops trying.
+bool Solver::spill(SearchContext &context)
+{
+    AnswerList &answers = context.answers;
+    if(answers.empty())
+        return true;
+
+    FILE *run = tmpfile();
+    bool ok = (run != NULL);
+    AnswerOrder order = { context.text.data() };
+    std::sort(answers.begin(), answers.end(), order);
+    for(AnswerList::iterator it = answers.begin(); ok && (it != answers.end()); ++it) {
+        int32_t score = it->score;
+        ok = (fwrite(&score, sizeof(score), 1, run) == 1)
+            && (fwrite(&it->length, sizeof(it->length), 1, run) == 1)
+            && (fwrite(&context.text[it->offset], 1, it->length, run) == it->length);
+    }
+    if(!ok) {
+        if(run)
+            fclose(run);
+        context.answerLimit = 0;
+        log("Failed to spill answers to a temporary file: %s; keeping them in memory.\n", strerror(errno));
+        return false;
+    }
+
+    context.runs.push_back(run);
+    answers.clear();
+    context.text.clear();
+    return true;
+}
+
+// One sorted run being merged, holding the next answer it has to offer.
+// A run is a spilled file, or with file NULL, answers a failed spill left
+// in a context's arena.
+struct RunCursor
+{
+    FILE *file;
+    const AnswerList *answers;
+    const char *arena;
+    size_t index;
+    std::string text;
+    int32_t score;
+
+    bool next()
+    {
+        if(!file) {
+            if(index == answers->size())
+                return false;
+            const Answer &answer = (*answers)[index++];
+            score = answer.score;
+            text.assign(arena + answer.offset, answer.length);
+            return true;
+        }
+
+        uint32_t length;
+        if((fread(&score, sizeof(score), 1, file) != 1) || (fread(&length, sizeof(length), 1, file) != 1))
+            return false;
+        text.resize(length);
+        return fread(&text[0], 1, length, file) == length;
+    }
+};
+
+// Heap order for RunCursor indices, with the best answer on top
+struct CursorOrder
+{
+    const std::vector<RunCursor> *cursors;
+
+    bool operator()(int a, int b) const
+    {
+        const RunCursor &x = (*cursors)[a];
+        const RunCursor &y = (*cursors)[b];
+        return sortScores(WordScore(y.text, y.score), WordScore(x.text, x.score));
+    }
+};
+
+// Factored lines end in a tab and the number of answers they expand to
+static unsigned long long factoredCount(std::string_view line)
+{
+    unsigned long long count = 0;
+    for(size_t i = line.rfind('\t') + 1; i < line.size(); ++i) {
+        count = count * 10 + (line[i] - '0');
+    }
+    return count;
+}
+
+// Writes every context's answers in score order by merging their spilled
+// runs, holding one answer per run in memory; closes the runs
+void Solver::writeRuns(std::vector<SearchContext> &contexts, FILE *out)
+{
+    std::vector<RunCursor> cursors;
+    for(std::vector<SearchContext>::iterator it = contexts.begin(); it != contexts.end(); ++it) {
+        RunCursor cursor;
+        cursor.answers = &it->answers;
+        cursor.arena = it->text.data();
+        cursor.index = 0;
+
+        // spill() sorts the answers even when it cannot write them, and
+        // then leaves them for a cursor of their own
+        if(!spill(*it)) {
+            cursor.file = NULL;
+            cursors.push_back(cursor);
+        }
+        for(std::vector<FILE *>::iterator run = it->runs.begin(); run != it->runs.end(); ++run) {
+            cursor.file = *run;
+            rewind(cursor.file);
+            cursors.push_back(cursor);
+        }
+        it->runs.clear();
+    }
+
+    std::vector<int> heap;
+    for(int i = 0; i < (int)cursors.size(); ++i) {
+        if(cursors[i].next())
+            heap.push_back(i);
+    }
+    CursorOrder order = { &cursors };
+    std::make_heap(heap.begin(), heap.end(), order);
+
+    unsigned long long written = 0;
+    unsigned long long expansions = 0;
+    while(!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), order);
+        RunCursor &cursor = cursors[heap.back()];
+        fwrite(cursor.text.data(), 1, cursor.text.size(), out);
+        fputc('\n', out);
+        ++written;
+        if(factored_)
+            expansions += factoredCount(cursor.text);
+
+        if(cursor.next())
+            std::push_heap(heap.begin(), heap.end(), order);
+        else
+            heap.pop_back();
+    }
+    for(std::vector<RunCursor>::iterator it = cursors.begin(); it != cursors.end(); ++it) {
+        if(it->file)
+            fclose(it->file);
+    }
+
+    log("Merged %d sorted runs.\n", (int)cursors.size());
+    if(factored_)
+        log("Found %llu answer groups expanding to %llu answers.\n", written, expansions);
+    else
+        log("Found %llu answers.\n", written);
+}
+
+void Solver::logPeak(const std::vector<SearchContext> &contexts, size_t mergeBytes)
+{
+    size_t memoBytes = 0;
+    size_t answerBytes = 0;
+    for(std::vector<SearchContext>::const_iterator it = contexts.begin(); it != contexts.end(); ++it) {
+        memoBytes += it->memo.peakBytes();
+        answerBytes += it->peakAnswerBytes;
+    }
+    log("Peak memory at most %llu KB: memo %llu KB, answers %llu KB, merge %llu KB.\n",
+        (unsigned long long)((memoBytes + answerBytes + mergeBytes) >> 10),
+        (unsigned long long)(memoBytes >> 10),
+        (unsigned long long)(answerBytes >> 10),
+        (unsigned long long)(mergeBytes >> 10));
+}
+
+// Orders letters by how many classes contain them
+struct SortLetters
+{
+    const std::vector<int> *covering;
+
+    SortLetters(const std::vector<int> *covering)
+    : covering(covering)
+    {
+    }
+
+    bool operator()(int a, int b) const
+    {
+        return covering[a].size() < covering[b].size();
+    }
+};
+
+void Solver::solveCount(FILE *out)
+{
+    CompletionMemo memo;
+    memo.setLimit(memoBudget());
+    Completions root;
+    complete(memo, packing_.pack(querySignature_), (int)sortedQuery_.size(), -1, 0, root);
+    uint64_t total = root.count;
+    log("Counted with %d memoized letter multisets.\n", (int)memo.size());
+    if(memo.evictions())
+        log("Memo limit reached; %llu entries were evicted.\n", (unsigned long long)memo.evictions());
+    if(truncated_)
+        log("Counting stopped early; the count is a lower bound.\n");
+
+    if(total == UINT64_MAX) {
+        log("Count overflowed 64 bits.\n");
+        fprintf(out, "%llu+\n", (unsigned long long)total);
+    } else {
+        fprintf(out, "%llu\n", (unsigned long long)total);
+    }
+}
+
+bool Solver::buildDag(SolutionDag &dag)
 {
-public:
-    Solver(const std::string &query);
-    ~Solver();
+    dag = SolutionDag();
+    bool searchable = prepare();
 
-    inline bool queryContains(const std::string &word);
+    DagNode empty;
+    memset(&empty, 0, sizeof(empty));
+    empty.count = 1;
+    dag.nodes.push_back(empty);
+    if(searchable) {
+        DagBuilder builder;
+        builder.dag = &dag;
+        builder.memo.setLimit(memoBudget());
+        builder.classes.assign(classes_.size(), -1);
+        builder.limit = memoryLimit_ ? memoryLimit_ - memoBudget() : 0;
+        builder.peak = 0;
+        builder.full = false;
+        addDagNode(builder, packing_.pack(querySignature_), (int)sortedQuery_.size(), -1, 0);
 
-    bool seed(const std::string &filename);
+        builder.peak = std::max(builder.peak, builder.bytes());
+        if(builder.full) {
+            truncated_ = true;
+            log("DAG memory ceiling reached; no more nodes were added.\n");
+        }
+        log("Peak memory at most %llu KB: memo %llu KB, DAG %llu KB.\n",
+            (unsigned long long)((builder.memo.peakBytes() + builder.peak) >> 10),
+            (unsigned long long)(builder.memo.peakBytes() >> 10),
+            (unsigned long long)(builder.peak >> 10));
+    }
 
-    std::string sanitize(const std::string &word);
+    // Readers rely on the QUERY node, so a query with nothing to search
+    // still gets one, without answers
+    if(dag.nodes.size() <= SolutionDag::QUERY) {
+        DagNode query;
+        memset(&query, 0, sizeof(query));
+        query.best = -1;
+        query.length = (uint32_t)sortedQuery_.size();
+        dag.nodes.push_back(query);
+    }
+    return searchable;
+}
 
-    void dump(bool dumpWords = false);
-    int permute(int length, int minLength);
-    void solve();
+// Adds the node for a sub-problem and, first, everything below it. Nodes
+// are shared between every path that reaches the same sub-problem.
+uint32_t Solver::addDagNode(DagBuilder &builder, PackedLetters remaining, int remainingLength, int letter, int first)
+{
+    if(remainingLength == 0)
+        return SolutionDag::EMPTY;
 
-    void forceAll() { forceAll_ = true; }
+    MemoKey key;
+    key.remaining = remaining;
+    key.first = first;
+    key.letter = letter;
+    std::unordered_map<MemoKey, uint32_t, MemoKeyHash>::iterator found = builder.nodes.find(key);
+    if(found != builder.nodes.end())
+        return found->second;
 
-protected:
-    int maxLength_;
-    std::string query_;
-    std::string sortedQuery_;
-    std::vector<WordScoreMap> scores_;
-    bool forceAll_;
-};
+    // Past the ceiling nothing more is added; callers drop the edge
+    if(!builder.full) {
+        size_t bytes = builder.bytes();
+        builder.peak = std::max(builder.peak, bytes);
+        builder.full = builder.limit && (bytes > builder.limit);
+    }
+    if(builder.full)
+        return SolutionDag::EMPTY;
 
-Solver::Solver(const std::string &query)
-: query_(query)
-, forceAll_(false)
+    SolutionDag &dag = *builder.dag;
+    // An interrupted solve leaves no edges to follow, so its node gets no
+    // answers either
+    Completions here;
+    if(!complete(builder.memo, remaining, remainingLength, letter, first, here)) {
+        here.count = 0;
+        here.best = -1;
+    }
+    uint32_t id = (uint32_t)dag.nodes.size();
+    builder.nodes[key] = id;
+
+    DagNode node;
+    node.count = here.count;
+    node.best = here.best;
+    node.length = (uint32_t)remainingLength;
+    node.firstEdge = 0;
+    node.edgeCount = 0;
+    dag.nodes.push_back(node);
+
+    // A node's edges must be contiguous, so they are only appended once
+    // every node below has been added
+    std::vector<DagEdge> edges;
+    if(remainingLength < 2 * minLength_) {
+        int classIndex = finalClass(remaining, remainingLength, first);
+        if(classIndex >= 0) {
+            DagEdge edge = { addDagClass(builder, classIndex), 1, SolutionDag::EMPTY };
+            edges.push_back(edge);
+        }
+    } else if(here.count) {
+        std::vector<int> classes;
+        builder.memo.edges(here, classes);
+        for(std::vector<int>::iterator it = classes.begin(); it != classes.end(); ++it) {
+            const WordClass &info = classes_[*it];
+            PackedLetters left = remaining;
+            int leftover = remainingLength;
+            for(uint32_t copies = 1; packing_.fits(left, info.packed); ++copies) {
+                leftover -= info.length;
+                if((leftover > 0) && (leftover < minLength_))
+                    break;
+
+                left -= info.packed;
+                bool lasts = packing_.has(left, here.letter);
+                uint32_t target = addDagNode(builder, left, leftover, lasts ? here.letter : -1, lasts ? *it + 1 : 0);
+                // EMPTY for letters left over means the ceiling was hit
+                bool added = (target != SolutionDag::EMPTY) || (leftover == 0);
+                if(added && dag.nodes[target].count) {
+                    DagEdge edge = { addDagClass(builder, *it), copies, target };
+                    edges.push_back(edge);
+                }
+            }
+        }
+    }
+
+    dag.nodes[id].firstEdge = (uint32_t)dag.edges.size();
+    dag.nodes[id].edgeCount = (uint32_t)edges.size();
+    dag.edges.insert(dag.edges.end(), edges.begin(), edges.end());
+    return id;
+}
+
+uint32_t Solver::addDagClass(DagBuilder &builder, int classIndex)
 {
-    sortedQuery_ = sanitize(query_);
-    maxLength_ = (int)sortedQuery_.size();
-    for(int i = 0; i <= maxLength_; ++i) {
-        scores_.push_back(WordScoreMap());
+    if(builder.classes[classIndex] >= 0)
+        return (uint32_t)builder.classes[classIndex];
+
+    SolutionDag &dag = *builder.dag;
+    const WordClass &info = classes_[classIndex];
+    DagClass wordClass;
+    wordClass.textOffset = (uint32_t)dag.text.size();
+    wordClass.wordCount = (uint32_t)info.wordCount;
+    for(int w = 0; w < info.wordCount; ++w) {
+        const char *word = dictionary_->word(info.firstWord + w);
+        dag.text.insert(dag.text.end(), word, word + strlen(word) + 1);
     }
+
+    builder.classes[classIndex] = (int)dag.classes.size();
+    dag.classes.push_back(wordClass);
+    return (uint32_t)builder.classes[classIndex];
 }
 
-Solver::~Solver()
+void Solver::solveDag(FILE *out)
 {
+    SolutionDag dag;
+    if(!buildDag(dag) || (dag.nodes.size() <= SolutionDag::QUERY))
+        return;
+    log("Built a DAG of %d nodes and %d edges over %d classes for %llu answers.\n",
+        (int)dag.nodes.size(),
+        (int)dag.edges.size(),
+        (int)dag.classes.size(),
+        (unsigned long long)dag.nodes[SolutionDag::QUERY].count);
+    if(truncated_)
+        log("Building stopped early; the DAG is incomplete.\n");
+
+    bool ok = (dagFormat_ == DAG_DOT) ? dag.writeDot(out) : dag.write(out);
+    if(!ok)
+        fprintf(stderr, "Failed to write the DAG.\n");
 }
 
-inline bool Solver::queryContains(const std::string &word)
+// Sets up the per-query search state; false if the query cannot be searched
+bool Solver::prepare()
 {
-    if(!word.size()) {
-        return false;
+    int queryLength = (int)sortedQuery_.size();
+    minLength_ = (queryLength >> 1) - 2;
+    if(minLength_ < 1)
+        minLength_ = 1;
+    if(forceAll_)
+        minLength_ = 1;
+
+    for(int letter = 0; letter < Signature::LETTERS; ++letter) {
+        covering_[letter].clear();
+        letterOrder_[letter] = letter;
+    }
+    for(int i = 0; i < (int)classes_.size(); ++i) {
+        if(classes_[i].length < minLength_)
+            continue;
+        for(uint32_t letters = classes_[i].letters; letters; letters &= letters - 1) {
+            covering_[__builtin_ctz(letters)].push_back(i);
+        }
+    }
+    std::stable_sort(letterOrder_, letterOrder_ + Signature::LETTERS, SortLetters(covering_));
+    return packable_ && lettersOnly_ && !sortedQuery_.empty();
+}
+
+// Sets up the query and logs what is about to be searched; false if it
+// cannot be searched
+bool Solver::begin()
+{
+    stopping_ = false;
+    truncated_ = false;
+    bool searchable = prepare();
+    if(forceAll_)
+        log("Force all enabled, setting min length to 1.\n");
+
+    log("Finding anagram for word '%s' (letters [%s]), length range [%d-%d].\n",
+        query_.c_str(),
+        sortedQuery_.c_str(),
+        minLength_,
+        maxLength_);
+    log("Searching %d signature classes covering %d words.\n",
+        (int)classes_.size(),
+        wordCount_);
+
+    if(sortedQuery_.empty())
+        log("Query has no letters; not searching.\n");
+    else if(!lettersOnly_)
+        log("Query has characters other than a-z; not searching.\n");
+    else if(!searchable)
+        log("Query repeats too many letters to pack into 128 bits; not searching.\n");
+    return searchable;
+}
+
+// Runs the whole search, one context per thread, leaving each thread's
+// answers in its context
+void Solver::searchAll(std::vector<SearchContext> &contexts)
+{
+    int queryLength = (int)sortedQuery_.size();
+    threshold_ = 0;
+
+    int threads = threads_;
+    if(threads < 1)
+        threads = (int)std::thread::hardware_concurrency();
+    if(threads < 1)
+        threads = 1;
+
+    // Top-K and streamed answers are bounded already, so only a full
+    // listing ever spills
+    size_t memoLimit = memoBudget();
+    size_t answerLimit = 0;
+    if(memoryLimit_ && !topK_ && !streaming_)
+        answerLimit = std::max((memoryLimit_ - memoLimit) / threads, (size_t)65536);
+
+    contexts.resize(threads);
+    for(std::vector<SearchContext>::iterator it = contexts.begin(); it != contexts.end(); ++it) {
+        it->remaining = packing_.pack(querySignature_);
+        it->memo.setLimit(memoLimit / threads);
+        it->answerLimit = answerLimit;
+    }
+
+    // A stream wants its first answers before the whole query is solved,
+    // and a search that may be cut short wants some answers to show for it
+    incremental_ = streaming_ || cancel_ || (deadline_ != std::chrono::steady_clock::time_point::max());
+
+    // Short queries finish with one word and have nothing to share out.
+    // Incremental mode shares out every class covering the root's letter,
+    // live or not, since finding out which are live is the full solve.
+    std::vector<int> tasks;
+    int letter = -1;
+    bool live = true;
+    if(!incremental_) {
+        Completions root;
+        complete(contexts[0].memo, contexts[0].remaining, queryLength, -1, 0, root);
+        contexts[0].memo.edges(root, tasks);
+        letter = root.letter;
+        live = (root.count > 0);
+    } else if(queryLength >= 2 * minLength_) {
+        letter = pickLetter(contexts[0].remaining, queryLength);
+        live = (letter >= 0);
+        if(live)
+            tasks = covering_[letter];
     }
+    if(live && ((threads == 1) || tasks.empty())) {
+        search(contexts[0], queryLength, -1, 0, 0);
+    } else if(live) {
+        log("Searching with %d threads.\n", threads);
+        searchParallel(contexts, tasks, queryLength, letter);
+    }
+
+    long long iterations = 0;
+    size_t memoized = 0;
+    size_t evictions = 0;
+    for(std::vector<SearchContext>::iterator it = contexts.begin(); it != contexts.end(); ++it) {
+        iterations += it->iterations;
+        memoized += it->memo.size();
+        evictions += it->memo.evictions();
+    }
+    log("Total iterations: %lld\n", iterations);
+    log("Memoized %llu letter multisets.\n", (unsigned long long)memoized);
+    if(evictions)
+        log("Memo limit reached; %llu entries were evicted.\n", (unsigned long long)evictions);
+    if(truncated_)
+        log("Search stopped early; the answers are incomplete.\n");
+}
 
-    std::string sortedWord = sanitize(word);
+void Solver::solve(FILE *out)
+{
+    stop();
+    if(!begin())
+        return;
+
+    if(countOnly_) {
+        solveCount(out);
+        return;
+    }
+    if(dagFormat_ != DAG_NONE) {
+        solveDag(out);
+        return;
+    }
 
-    const char *w = sortedWord.c_str();
-    const char *q = sortedQuery_.c_str();
+    std::vector<SearchContext> contexts;
+    searchAll(contexts);
 
-    while(*q) {
-        if(*w == *q) {
-            ++w;
+    // Once any thread has spilled, everything is merged from disk
+    for(std::vector<SearchContext>::iterator it = contexts.begin(); it != contexts.end(); ++it) {
+        if(!it->runs.empty()) {
+            writeRuns(contexts, out);
+            logPeak(contexts, 0);
+            return;
         }
-        ++q;
+    }
 
-        if(!*w)
-            return true;
+    // Threads never share a class multiset, so their answers never overlap
+    WordScoreList answers;
+    for(std::vector<SearchContext>::iterator it = contexts.begin(); it != contexts.end(); ++it) {
+        const char *text = it->text.data();
+        for(AnswerList::iterator answer = it->answers.begin(); answer != it->answers.end(); ++answer) {
+            answers.push_back(WordScore(std::string_view(text + answer->offset, answer->length), answer->score));
+        }
     }
 
-    return false;
+    // Sort by score so cooler anagrams are first
+    std::sort(answers.begin(), answers.end(), sortScores);
+    if(topK_ && ((int)answers.size() > topK_)) {
+        answers.resize(topK_);
+    }
+
+    logPeak(contexts, answers.capacity() * sizeof(WordScore));
+    if(factored_) {
+        unsigned long long expansions = 0;
+        for(WordScoreList::iterator it = answers.begin(); it != answers.end(); ++it) {
+            expansions += factoredCount(it->first);
+        }
+        log("Found %d answer groups expanding to %llu answers.\n", (int)answers.size(), expansions);
+    } else {
+        log("Found %d answers.\n", (int)answers.size());
+    }
+    for(WordScoreList::iterator it = answers.begin(); it != answers.end(); ++it) {
+        fwrite(it->first.data(), 1, it->first.size(), out);
+        fputc('\n', out);
+    }
 }
 
-bool Solver::seed(const std::string &filename)
+bool Solver::start()
 {
-    std::ifstream f(filename.c_str());
-    if(!f) {
+    stop();
+    if(!begin())
         return false;
+
+    stream_.reset();
+    streaming_ = true;
+    stopping_ = false;
+    producer_ = std::thread(&Solver::produce, this);
+    return true;
+}
+
+void Solver::produce()
+{
+    std::vector<SearchContext> contexts;
+    searchAll(contexts);
+    logPeak(contexts, 0);
+    stream_.close();
+}
+
+bool Solver::next(std::string &phrase)
+{
+    return streaming_ && stream_.pop(phrase);
+}
+
+// Abandons a streaming search, waiting for its thread to wind down
+void Solver::stop()
+{
+    if(!producer_.joinable())
+        return;
+    stopping_ = true;
+    stream_.cancel();
+    producer_.join();
+    streaming_ = false;
+    stopping_ = false;
+}
+
+// One query and the options that shape its answers, whether it came from
+// the command line or from a --serve client.
+struct Query
+{
+    std::string letters;
+    bool all;
+    bool factored;
+    int threads;
+    int topK;
+    bool countOnly;
+    bool stream; // print answers as they are found, unsorted
+    DagFormat dagFormat;
+    int memoMegabytes;   // cap on the search's sub-problem memo, 0 for none
+    int memoryMegabytes; // ceiling on the search's memory, 0 for none
+    int timeoutMs;       // stop searching after this long, 0 for never
+    int cacheMegabytes;  // --serve and --batch result cache, 0 for none
+
+    Query()
+    : all(false)
+    , factored(false)
+    , threads(1)
+    , topK(0)
+    , countOnly(false)
+    , stream(false)
+    , dagFormat(DAG_NONE)
+    , memoMegabytes(256)
+    , memoryMegabytes(0)
+    , timeoutMs(0)
+    , cacheMegabytes(64)
+    {
     }
+};
 
-    std::string word;
-    while(std::getline(f, word)) {
-        int length = (int)word.size();
-        if(length > maxLength_)
-            continue;
-        if(!queryContains(word))
-            continue;
+// Finished output of recent queries, shared by every --serve client or
+// --batch worker. Queries that differ only in letter order or spacing have
+// the same answers, so they share an entry; the least recently used
+// entries go once the entries' bytes exceed the budget.
+class ResultCache
+{
+public:
+    explicit ResultCache(size_t budget)
+    : budget_(budget)
+    , bytes_(0)
+    , hits_(0)
+    {
+    }
 
-        scores_[length][word] = length * length;
+    bool find(const std::string &key, std::string &result)
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        Index::iterator it = index_.find(key);
+        if(it == index_.end())
+            return false;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        result = it->second->second;
+        ++hits_;
+        return true;
     }
 
-    return true;
+    void insert(const std::string &key, const std::string &result)
+    {
+        size_t bytes = entryBytes(key, result);
+        if(bytes > budget_ / ENTRY_SHARE)
+            return;
+
+        std::lock_guard<std::mutex> guard(lock_);
+        if(index_.count(key))
+            return;
+        entries_.push_front(Entry(key, result));
+        index_[key] = entries_.begin();
+        bytes_ += bytes;
+        while(bytes_ > budget_) {
+            Entry &oldest = entries_.back();
+            bytes_ -= entryBytes(oldest.first, oldest.second);
+            index_.erase(oldest.first);
+            entries_.pop_back();
+        }
+    }
+
+    // The largest result that could be stored under key
+    size_t capacity(const std::string &key) const
+    {
+        size_t overhead = entryBytes(key, std::string());
+        return (budget_ / ENTRY_SHARE > overhead) ? budget_ / ENTRY_SHARE - overhead : 0;
+    }
+
+    int hits()
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        return hits_;
+    }
+
+protected:
+    // No entry may take more than this fraction of the budget, so one huge
+    // result cannot flush everything else, nor be held back at full size
+    enum { ENTRY_SHARE = 8 };
+
+    typedef std::pair<std::string, std::string> Entry;
+    typedef std::unordered_map<std::string, std::list<Entry>::iterator> Index;
+
+    // The key is stored twice, in the entry and the index, plus roughly
+    // the list and hash nodes around them
+    static size_t entryBytes(const std::string &key, const std::string &result)
+    {
+        return 2 * key.size() + result.size() + 128;
+    }
+
+    std::mutex lock_;
+    std::list<Entry> entries_; // most recently used first
+    Index index_;
+    size_t budget_;
+    size_t bytes_;
+    int hits_;
+};
+
+// The query's letters in canonical order plus every option that changes
+// its output; threads, memory caps and streaming do not
+static std::string cacheKey(const Query &query)
+{
+    char options[64];
+    snprintf(options, sizeof(options), "|%d%d%d|%d|%d", query.all, query.factored, query.countOnly, query.topK, (int)query.dagFormat);
+    return Solver::sanitize(query.letters) + options;
 }
 
-std::string Solver::sanitize(const std::string &word)
+// Returns false if the query ran out of time and its answers are incomplete
+static bool runQuery(const Dictionary &dictionary, const Query &query, FILE *out, FILE *log)
 {
-    std::string sortedWord = word;
-    sortedWord.erase(std::remove(sortedWord.begin(), sortedWord.end(), ' '), sortedWord.end());
-    std::sort(sortedWord.begin(), sortedWord.end());
-    return sortedWord;
+    // The deadline covers seeding too, since that is part of the wait
+    Solver solver(query.letters);
+    solver.setLog(log);
+    if(query.timeoutMs > 0) {
+        solver.setDeadline(std::chrono::steady_clock::now() + std::chrono::milliseconds(query.timeoutMs));
+    }
+    if(query.all) {
+        solver.forceAll();
+    }
+    if(query.factored) {
+        solver.factorOutput();
+    }
+    solver.setThreads(query.threads);
+    solver.setTopK(query.topK);
+    solver.setMemoLimit((size_t)query.memoMegabytes << 20);
+    solver.setMemoryLimit((size_t)query.memoryMegabytes << 20);
+    solver.setDagFormat(query.dagFormat);
+    if(query.countOnly) {
+        solver.countOnly();
+    }
+    solver.seed(dictionary);
+
+    if(!query.stream || query.countOnly || (query.dagFormat != DAG_NONE)) {
+        solver.solve(out);
+        return !solver.truncated();
+    }
+
+    // Flush only when the next answer is not already waiting, so a reader
+    // sees each answer promptly without a write per line on a fast search
+    std::string phrase;
+    if(!solver.start())
+        return true;
+    while(solver.next(phrase)) {
+        fwrite(phrase.data(), 1, phrase.size(), out);
+        fputc('\n', out);
+        if(!solver.ready() && (fflush(out) != 0))
+            break;
+    }
+    fflush(out);
+    return !solver.truncated();
 }
 
-void Solver::dump(bool dumpWords)
+// Holds a query's output back for the cache until it grows past what the
+// cache could store, then writes it through to out and holds nothing more
+struct CacheWriter
 {
-    fprintf(stderr, "Current word list counts:\n");
-    for(int i = 0; i <= maxLength_; ++i) {
-        printf("* Scores[%d]: %d\n", i, (int)scores_[i].size());
-        if(dumpWords) {
-            for(WordScoreMap::iterator it = scores_[i].begin(); it != scores_[i].end(); ++it) {
-                fprintf(stderr, "  * %s\n", it->first.c_str());
+    FILE *out;
+    std::string buffer;
+    size_t limit;
+    bool passthrough;
+
+    static ssize_t write(void *cookie, const char *data, size_t size)
+    {
+        CacheWriter *writer = (CacheWriter *)cookie;
+        if(writer->passthrough)
+            return (ssize_t)fwrite(data, 1, size, writer->out);
+
+        if(writer->buffer.size() + size <= writer->limit) {
+            writer->buffer.append(data, size);
+            return (ssize_t)size;
+        }
+        fwrite(writer->buffer.data(), 1, writer->buffer.size(), writer->out);
+        std::string().swap(writer->buffer);
+        writer->passthrough = true;
+        return (ssize_t)fwrite(data, 1, size, writer->out);
+    }
+};
+
+// runQuery() through the cache. A miss is held back so it can be stored,
+// unless it outgrows the cache or is streamed, where holding answers back
+// would defeat the point; answers cut short by a timeout are never stored.
+// Streaming ignores -k, so a streamed top-K query skips the cache entirely.
+static bool runCachedQuery(const Dictionary &dictionary, const Query &query, ResultCache *cache, FILE *out, FILE *log)
+{
+    if(!cache || (query.stream && query.topK))
+        return runQuery(dictionary, query, out, log);
+
+    std::string key = cacheKey(query);
+    std::string result;
+    if(cache->find(key, result)) {
+        fwrite(result.data(), 1, result.size(), out);
+        return true;
+    }
+    if(query.stream)
+        return runQuery(dictionary, query, out, log);
+
+    CacheWriter writer;
+    writer.out = out;
+    writer.limit = cache->capacity(key);
+    writer.passthrough = false;
+    cookie_io_functions_t functions;
+    memset(&functions, 0, sizeof(functions));
+    functions.write = CacheWriter::write;
+    FILE *stream = fopencookie(&writer, "w", functions);
+    if(!stream)
+        return runQuery(dictionary, query, out, log);
+    bool complete = runQuery(dictionary, query, stream, log);
+    fclose(stream);
+
+    if(!writer.passthrough) {
+        fwrite(writer.buffer.data(), 1, writer.buffer.size(), out);
+        if(complete)
+            cache->insert(key, writer.buffer);
+    }
+    return complete;
+}
+
+// Lists every answer in a DAG written by --dag binary, one factored line per
+// path as it is reached, with the number of phrases the line stands for
+static int walkDag(const std::string &filename, FILE *out)
+{
+    SolutionDag dag;
+    if(!dag.read(filename)) {
+        fprintf(stderr, "Failed to read DAG '%s'.\n", filename.c_str());
+        return 1;
+    }
+
+    DagWalker walker(dag);
+    std::string line;
+    while(walker.next()) {
+        line.clear();
+        unsigned long long expansions = 1;
+        const std::vector<DagEdge> &path = walker.path();
+        for(std::vector<DagEdge>::const_iterator it = path.begin(); it != path.end(); ++it) {
+            // Each class appears on one edge only, so r copies of a class with
+            // n words contribute C(n + r - 1, r) choices
+            unsigned long long n = dag.classes[it->wordClass].wordCount;
+            unsigned long long choices = 1;
+            for(unsigned long long r = 1; r <= it->copies; ++r) {
+                choices = choices * (n + r - 1) / r;
+                if(!line.empty())
+                    line += ' ';
+                dag.appendClass(it->wordClass, line);
             }
+            expansions *= choices;
         }
+        fprintf(out, "%s\t%llu\n", line.c_str(), expansions);
     }
+    return 0;
 }
 
-static bool sortScores(WordScore a, WordScore b)
+// A request line is the query letters, optionally preceded by -a,
+// --factored, --count and/or -k N. Returns false if the line holds no letters.
+static bool parseQueryLine(const std::string &line, Query &query)
 {
-    if(b.second == a.second) {
-        // Sort identical scores alphabetically
-        return a.first < b.first;
+    std::vector<std::string> tokens;
+    size_t pos = 0;
+    while(pos < line.size()) {
+        size_t end = line.find_first_of(" \t\r\n", pos);
+        if(end == std::string::npos)
+            end = line.size();
+        if(end > pos)
+            tokens.push_back(line.substr(pos, end - pos));
+        pos = end + 1;
     }
-    return (b.second < a.second);
+
+    for(size_t i = 0; i < tokens.size(); ++i) {
+        const std::string &token = tokens[i];
+        if(token == "-a") {
+            query.all = true;
+        } else if(token == "--factored") {
+            query.factored = true;
+        } else if(token == "--count") {
+            query.countOnly = true;
+        } else if(token == "--stream") {
+            query.stream = true;
+        } else if((token == "-k") && (i + 1 < tokens.size())) {
+            query.topK = atoi(tokens[++i].c_str());
+        } else if((token == "--memory-mb") && (i + 1 < tokens.size())) {
+            query.memoryMegabytes = atoi(tokens[++i].c_str());
+        } else if((token == "--timeout-ms") && (i + 1 < tokens.size())) {
+            query.timeoutMs = atoi(tokens[++i].c_str());
+        } else {
+            if(!query.letters.empty())
+                query.letters += " ";
+            query.letters += token;
+        }
+    }
+    return !Solver::sanitize(query.letters).empty() && (query.topK >= 0);
+}
+
+// Counts the --serve client threads, so the server can hold new
+// connections back once enough are running and wait for the rest before it
+// lets the dictionary go
+class ClientCount
+{
+public:
+    explicit ClientCount(int limit) : limit_(limit), active_(0) {}
+
+    // Waits for a free slot and takes it
+    void enter()
+    {
+        std::unique_lock<std::mutex> guard(lock_);
+        changed_.wait(guard, [this] { return active_ < limit_; });
+        active_++;
+    }
+
+    // Notifies under the lock, so the server cannot return from drain() and
+    // destroy the count until this thread is done with it
+    void leave()
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        active_--;
+        changed_.notify_all();
+    }
+
+    void drain()
+    {
+        std::unique_lock<std::mutex> guard(lock_);
+        changed_.wait(guard, [this] { return active_ == 0; });
+    }
+
+protected:
+    std::mutex lock_;
+    std::condition_variable changed_;
+    int limit_;
+    int active_;
+};
+
+// Answers newline-delimited queries from one --serve client. Each answer is
+// the usual output lines followed by an empty line, with a "#truncated" line
+// before that if the query's --timeout-ms ran out.
+static void serveClient(const Dictionary *dictionary, ResultCache *cache, ClientCount *clients, int fd)
+{
+    FILE *in = fdopen(fd, "r");
+    FILE *out = fdopen(dup(fd), "w");
+    if(!in || !out) {
+        if(in)
+            fclose(in);
+        else
+            close(fd);
+        if(out)
+            fclose(out);
+        clients->leave();
+        return;
+    }
+
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    ssize_t lineLength;
+    while((lineLength = getline(&line, &lineCapacity, in)) >= 0) {
+        Query query;
+        if(parseQueryLine(std::string(line, lineLength), query)) {
+            if(!runCachedQuery(*dictionary, query, cache, out, NULL))
+                fprintf(out, "#truncated\n");
+        }
+        fprintf(out, "\n");
+        if(fflush(out) != 0)
+            break;
+    }
+
+    free(line);
+    fclose(in);
+    fclose(out);
+    clients->leave();
 }
 
-int Solver::permute(int length, int minLength)
+// Shared between the --batch workers: queries are taken a line at a time
+// and their answers written in ID-prefixed chunks
+struct Batch
+{
+    const Dictionary *dictionary;
+    ResultCache *cache;
+    Query defaults;
+    FILE *in;
+    FILE *out;
+    std::mutex inLock;
+    std::mutex outLock;
+    int lineNumber;
+    int solved;
+    int invalid;
+};
+
+// Collects one query's output and writes it to the batch output with every
+// line prefixed by the query's ID. Whole lines go out whenever a chunk's
+// worth has built up, so a query costs a chunk of memory however many
+// answers it has; other queries' lines may come between its chunks.
+struct BatchWriter
+{
+    enum { CHUNK = 65536 };
+
+    Batch *batch;
+    std::string id;
+    std::string pending;
+
+    // Writes every complete line held, or everything when finishing
+    void flush(bool finish)
+    {
+        size_t end = finish ? pending.size() : pending.rfind('\n') + 1;
+        if(end == 0 && !finish)
+            return;
+
+        std::lock_guard<std::mutex> guard(batch->outLock);
+        for(size_t start = 0; start < end;) {
+            size_t newline = pending.find('\n', start);
+            size_t next = (newline == std::string::npos || newline >= end) ? end : newline + 1;
+            fwrite(id.data(), 1, id.size(), batch->out);
+            fputc('\t', batch->out);
+            fwrite(pending.data() + start, 1, next - start, batch->out);
+            if(pending[next - 1] != '\n')
+                fputc('\n', batch->out);
+            start = next;
+        }
+        pending.erase(0, end);
+        if(finish)
+            fprintf(batch->out, "%s\t\n", id.c_str());
+    }
+
+    static ssize_t write(void *cookie, const char *data, size_t size)
+    {
+        BatchWriter *writer = (BatchWriter *)cookie;
+        writer->pending.append(data, size);
+        if(writer->pending.size() >= CHUNK)
+            writer->flush(false);
+        return (ssize_t)size;
+    }
+};
+
+static void runBatchWorker(Batch *batch)
 {
-    int iterations = 0;
-    for(int scores1Length = length - minLength; scores1Length >= minLength; --scores1Length) {
-        int scores2Length = length - scores1Length;
-        if(scores2Length > scores1Length)
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    cookie_io_functions_t functions;
+    memset(&functions, 0, sizeof(functions));
+    functions.write = BatchWriter::write;
+    for(;;) {
+        ssize_t lineLength;
+        int lineNumber;
+        {
+            std::lock_guard<std::mutex> guard(batch->inLock);
+            lineLength = getline(&line, &lineCapacity, batch->in);
+            lineNumber = ++batch->lineNumber;
+        }
+        if(lineLength < 0)
             break;
 
-        WordScoreMap &scores1 = scores_[scores1Length];
-        WordScoreMap &scores2 = scores_[scores2Length];
-        WordScoreMap &destScores = scores_[length];
-        if((scores1.size() == 0) || (scores2.size() == 0))
-            continue;
+        std::string text(line, lineLength);
+        BatchWriter writer;
+        writer.batch = batch;
+        size_t tab = text.find('\t');
+        if(tab != std::string::npos) {
+            writer.id = text.substr(0, tab);
+            text.erase(0, tab + 1);
+        } else {
+            writer.id = std::to_string(lineNumber);
+        }
+        Query query = batch->defaults;
+        bool valid = parseQueryLine(text, query);
 
-        iterations += (int)(scores1.size() * scores2.size());
-
-        fprintf(stderr, "* permute into list[%d] -> list[%d] x list[%d] = %d * %d = %d combinations\n",
-            length,
-            scores1Length,
-            scores2Length,
-            (int)scores1.size(),
-            (int)scores2.size(),
-            (int)(scores1.size() * scores2.size()));
-
-        for(WordScoreMap::iterator scores1It = scores1.begin(); scores1It != scores1.end(); ++scores1It) {
-            for(WordScoreMap::iterator scores2It = scores2.begin(); scores2It != scores2.end(); ++scores2It) {
-                // sort the word combos prior to concat to eliminate word combo dupes
-                std::string combined;
-                if(scores1It->first < scores2It->first)
-                    combined = scores1It->first + " " + scores2It->first;
-                else
-                    combined = scores2It->first + " " + scores1It->first;
-
-                // Only add the combo if it could ever be a part an anagram of query_
-                if(queryContains(combined))
-                    destScores[combined] = scores1It->second + scores2It->second;
-            }
+        FILE *out = fopencookie(&writer, "w", functions);
+        if(!out) {
+            fprintf(stderr, "Failed to open the output of query %s: %s\n", writer.id.c_str(), strerror(errno));
+            writer.pending = "#failed\n";
+        } else {
+            if(!valid)
+                fprintf(out, "#invalid\n");
+            else if(!runCachedQuery(*batch->dictionary, query, batch->cache, out, NULL))
+                fprintf(out, "#truncated\n");
+            fclose(out);
         }
+        writer.flush(true);
+
+        std::lock_guard<std::mutex> guard(batch->outLock);
+        if(valid)
+            ++batch->solved;
+        else
+            ++batch->invalid;
     }
-    return iterations;
+    free(line);
 }
 
-void Solver::solve()
+// Solves every line of filename ("-" for stdin) against one loaded
+// dictionary, spreading the queries over defaults.threads workers that
+// each search single-threaded. A line is a query as --serve takes it,
+// optionally preceded by an ID and a tab; without one, the line number is
+// the ID. Every answer line is written as the ID, a tab, and the answer,
+// and each query ends with a line of just its ID and a tab, even when it
+// has no answers; a large answer may be interleaved with others before
+// that. A line that is not a query gets a "#invalid" answer.
+static int runBatch(const Dictionary &dictionary, const std::string &filename, const Query &defaults)
 {
-    int queryLength = (int)sortedQuery_.size();
+    bool useStdin = (filename == "-");
+    FILE *in = useStdin ? stdin : fopen(filename.c_str(), "r");
+    if(!in) {
+        fprintf(stderr, "Failed to open queries '%s': %s\n", filename.c_str(), strerror(errno));
+        return 1;
+    }
+
+    int workerCount = defaults.threads;
+    if(workerCount < 1)
+        workerCount = (int)std::thread::hardware_concurrency();
+    if(workerCount < 1)
+        workerCount = 1;
 
-    int minLength = (queryLength >> 1) - 2;
-    if(minLength < 1)
-        minLength = 1;
-    if(forceAll_) {
-        fprintf(stderr, "Force all enabled, setting min length to 1.\n");
-        minLength = 1;
+    ResultCache cache((size_t)defaults.cacheMegabytes << 20);
+    Batch batch;
+    batch.dictionary = &dictionary;
+    batch.cache = (defaults.cacheMegabytes > 0) ? &cache : NULL;
+    batch.defaults = defaults;
+    batch.defaults.threads = 1;
+    batch.defaults.stream = false;
+    batch.defaults.letters.clear();
+    batch.in = in;
+    batch.out = stdout;
+    batch.lineNumber = 0;
+    batch.solved = 0;
+    batch.invalid = 0;
+
+    std::vector<std::thread> workers;
+    for(int worker = 0; worker < workerCount; ++worker) {
+        workers.push_back(std::thread(runBatchWorker, &batch));
+    }
+    for(std::vector<std::thread>::iterator it = workers.begin(); it != workers.end(); ++it) {
+        it->join();
     }
 
-    fprintf(stderr, "Finding anagram for word '%s' (letters [%s]), length range [%d-%d].\n",
-        query_.c_str(),
-        sortedQuery_.c_str(),
-        minLength,
-        maxLength_);
+    if(!useStdin)
+        fclose(in);
+    fprintf(stderr, "Solved %d queries with %d workers, %d from the cache.\n", batch.solved, workerCount, cache.hits());
+    if(batch.invalid)
+        fprintf(stderr, "Skipped %d lines that were not queries.\n", batch.invalid);
+    return (fflush(stdout) == 0) ? 0 : 1;
+}
 
-    int iterations = 0;
-    for(int i = 0; i <= sortedQuery_.size(); ++i) {
-        iterations += permute(i, minLength);
+// Client threads --serve runs at once
+enum { MAX_CLIENTS = 64 };
+
+// Loads nothing itself: every client thread shares the already loaded
+// dictionary, so a query costs only its seed() and search.
+static int serve(const Dictionary &dictionary, const std::string &socketPath, int cacheMegabytes)
+{
+    struct sockaddr_un address;
+    if(socketPath.size() >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long.\n", socketPath.c_str());
+        return 1;
     }
-    fprintf(stderr, "Total iterations: %d\n", iterations);
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, socketPath.c_str(), socketPath.size());
 
-    fprintf(stderr, "\nFound %d possible anagrams.\n",
-		(int)scores_[queryLength].size());
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listenFd < 0) {
+        fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+        return 1;
+    }
 
-    WordScoreList answers;
-    for(WordScoreMap::iterator it = scores_[queryLength].begin(); it != scores_[queryLength].end(); ++it) {
-        if(queryContains(it->first))
-            answers.push_back(*it);
+    // Clear out a socket left by an earlier server, but never anything else
+    // that happens to be at the path, nor a socket a live server still answers
+    struct stat st;
+    if((lstat(socketPath.c_str(), &st) == 0) && S_ISSOCK(st.st_mode)) {
+        int probeFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(probeFd < 0) {
+            fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+            close(listenFd);
+            return 1;
+        }
+        bool stale = (connect(probeFd, (struct sockaddr *)&address, sizeof(address)) != 0) && (errno == ECONNREFUSED);
+        close(probeFd);
+        if(stale)
+            unlink(socketPath.c_str());
+    }
+    if((bind(listenFd, (struct sockaddr *)&address, sizeof(address)) != 0) || (listen(listenFd, 64) != 0)) {
+        fprintf(stderr, "Failed to listen on '%s': %s\n", socketPath.c_str(), strerror(errno));
+        close(listenFd);
+        return 1;
     }
 
-    // Sort by score so cooler anagrams are first
-    std::sort(answers.begin(), answers.end(), sortScores);
+    // A client hanging up mid-answer must not take the server down
+    signal(SIGPIPE, SIG_IGN);
 
-    fprintf(stderr, "Found %d answers.\n", (int)answers.size());
-    for(WordScoreList::iterator it = answers.begin(); it != answers.end(); ++it) {
-        printf("%s\n", it->first.c_str());
+    // Client threads are detached, but the server drains them before it
+    // returns, so the cache and the count outlive every one of them
+    ResultCache *cache = (cacheMegabytes > 0) ? new ResultCache((size_t)cacheMegabytes << 20) : NULL;
+    ClientCount clients(MAX_CLIENTS);
+
+    fprintf(stderr, "Serving %d words on '%s'.\n", dictionary.wordCount(), socketPath.c_str());
+    for(;;) {
+        // Past the limit, new connections wait in the listen backlog
+        clients.enter();
+        int clientFd = accept(listenFd, NULL, NULL);
+        if(clientFd < 0) {
+            int error = errno;
+            clients.leave();
+            if(error == EINTR)
+                continue;
+            fprintf(stderr, "Failed to accept connection: %s\n", strerror(error));
+            // Running out of descriptors or memory passes as clients hang up,
+            // and a client that gave up before being accepted costs nothing
+            if((error == EMFILE) || (error == ENFILE) || (error == ENOBUFS) || (error == ENOMEM)) {
+                usleep(100 * 1000);
+                continue;
+            }
+            if((error == ECONNABORTED) || (error == EPROTO) || (error == EPERM))
+                continue;
+            break;
+        }
+        try {
+            std::thread(serveClient, &dictionary, cache, &clients, clientFd).detach();
+        } catch(const std::system_error &e) {
+            fprintf(stderr, "Failed to start client thread: %s\n", e.what());
+            close(clientFd);
+            clients.leave();
+        }
     }
+
+    close(listenFd);
+    clients.drain();
+    delete cache;
+    return 1;
 }
 
 int main(int argc, char *argv[])
 {
-    std::string query;
-    bool all = false;
+    Query query;
+    std::string dictionaryFilename = "data/words";
+    std::string indexSource;
+    std::string indexFilename;
+    std::string socketPath;
+    std::string dagFilename;
+    std::string batchFilename;
+    bool threadsGiven = false;
 
     for(int i = 1; i < argc; ++i) {
         const char *arg = argv[i];
         if(!strcmp(arg, "-a")) {
-            all = true;
+            query.all = true;
+        } else if(!strcmp(arg, "--factored")) {
+            query.factored = true;
+        } else if(!strcmp(arg, "--count")) {
+            query.countOnly = true;
+        } else if(!strcmp(arg, "--stream")) {
+            query.stream = true;
+        } else if(!strcmp(arg, "-k") && (i + 1 < argc)) {
+            query.topK = atoi(argv[++i]);
+        } else if(!strcmp(arg, "-j") && (i + 1 < argc)) {
+            query.threads = atoi(argv[++i]);
+            threadsGiven = true;
+        } else if(!strcmp(arg, "--dag") && (i + 1 < argc)) {
+            const char *format = argv[++i];
+            query.dagFormat = !strcmp(format, "dot") ? DAG_DOT : DAG_BINARY;
+        } else if(!strcmp(arg, "--walk-dag") && (i + 1 < argc)) {
+            dagFilename = argv[++i];
+        } else if(!strcmp(arg, "--timeout-ms") && (i + 1 < argc)) {
+            query.timeoutMs = atoi(argv[++i]);
+        } else if(!strcmp(arg, "--memory-mb") && (i + 1 < argc)) {
+            query.memoryMegabytes = atoi(argv[++i]);
+        } else if(!strcmp(arg, "--memo-mb") && (i + 1 < argc)) {
+            query.memoMegabytes = atoi(argv[++i]);
+        } else if(!strcmp(arg, "-d") && (i + 1 < argc)) {
+            dictionaryFilename = argv[++i];
+        } else if(!strcmp(arg, "--build-index") && (i + 1 < argc)) {
+            indexSource = argv[++i];
+        } else if(!strcmp(arg, "-o") && (i + 1 < argc)) {
+            indexFilename = argv[++i];
+        } else if(!strcmp(arg, "--serve") && (i + 1 < argc)) {
+            socketPath = argv[++i];
+        } else if(!strcmp(arg, "--cache-mb") && (i + 1 < argc)) {
+            query.cacheMegabytes = atoi(argv[++i]);
+        } else if(!strcmp(arg, "--batch") && (i + 1 < argc)) {
+            batchFilename = argv[++i];
         } else {
-            query = arg;
+            query.letters = arg;
         }
     }
 
-    if(query.size() < 1) {
-        fprintf(stderr, "Syntax: anagram [-a] [letters]\n");
+    if(query.topK < 0) {
+        fprintf(stderr, "The -k count must not be negative.\n");
+        return 1;
+    }
+
+    if(!indexSource.empty()) {
+        if(indexFilename.empty()) {
+            fprintf(stderr, "Syntax: anagram --build-index [words] -o [index]\n");
+            return 1;
+        }
+
+        Dictionary dictionary;
+        if(!dictionary.load(indexSource)) {
+            fprintf(stderr, "Failed to load dictionary '%s'.\n", indexSource.c_str());
+            return 1;
+        }
+        if(!dictionary.writeIndex(indexFilename)) {
+            fprintf(stderr, "Failed to write index '%s'.\n", indexFilename.c_str());
+            return 1;
+        }
+        fprintf(stderr, "Wrote %d words in %d signature classes to '%s'.\n",
+            dictionary.wordCount(),
+            dictionary.classCount(),
+            indexFilename.c_str());
         return 0;
     }
 
-    Solver solver(query);
-    if(all) {
-        solver.forceAll();
+    if(!dagFilename.empty()) {
+        return walkDag(dagFilename, stdout);
+    }
+
+    if(Solver::sanitize(query.letters).empty() && socketPath.empty() && batchFilename.empty()) {
+        fprintf(stderr, "Syntax: anagram [-a] [--factored] [--count] [--stream] [-k count] [-j threads] [--timeout-ms ms] [--memo-mb megabytes] [--memory-mb megabytes] [--dag binary|dot] [-d dictionary] [letters]\n");
+        fprintf(stderr, "        anagram --walk-dag [dag]\n");
+        fprintf(stderr, "        anagram [-d dictionary] [--cache-mb megabytes] --serve [socket]\n");
+        fprintf(stderr, "        anagram [-d dictionary] [-j workers] [--cache-mb megabytes] [options] --batch [queries|-]\n");
+        fprintf(stderr, "        anagram --build-index [words] -o [index]\n");
+        return 0;
+    }
+
+    // Accepts either a plain word list or an index from --build-index
+    Dictionary dictionary;
+    if(!dictionary.load(dictionaryFilename)) {
+        fprintf(stderr, "Failed to load dictionary '%s'.\n", dictionaryFilename.c_str());
+        return 1;
+    }
+
+    if(!socketPath.empty()) {
+        return serve(dictionary, socketPath, query.cacheMegabytes);
+    }
+    if(!batchFilename.empty()) {
+        // Without -j a batch uses every hardware thread, one query on each
+        if(!threadsGiven)
+            query.threads = 0;
+        return runBatch(dictionary, batchFilename, query);
     }
-    solver.seed("data/words");
-    solver.solve();
 
+    runQuery(dictionary, query, stdout, stderr);
     return 0;
 }